@@ -0,0 +1,183 @@
+#include "common.h"
+#include "gphm.h"
+#include "lex.h"
+#include "num.h"
+#include "rhhm.h"
+#include "value.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * micro benchmarks, run with: make bench && ./bench
+ */
+
+void lua_error(state *L) { abort(); }
+
+static u64 ntime() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * (u64)1e9 + t.tv_nsec;
+}
+
+static u64 rng = 88172645463325252ULL;
+static u64 xorshift() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+#define BENCH_CAP (1<<20)
+#define BENCH_LOOKUPS (1<<22)
+
+static bv *bench_keys(u32 n) {
+	bv *k = ML_MALLOC(n * sizeof(bv));
+	for (u32 i = 0; i < n; i++) k[i] = bv_make_double(xorshift() >> 12);
+	return k;
+}
+
+static volatile u64 sink;
+
+/* rhhm vs gphm lookups */
+static void bench_hm(u32 load) {
+	u32 n = (u64)BENCH_CAP * load / 100;
+	bv *present = bench_keys(n);
+	bv *absent = bench_keys(n);
+
+	rhhm r;
+	rhhm_init(&r, BENCH_CAP, 0);
+	rhhm_set_max_load(&r, RHHM_MAX_LOAD_MAX);
+	gphm g;
+	gphm_init(&g, BENCH_CAP, 0);
+
+	for (u32 i = 0; i < n; i++) {
+		hm_set(&r, present[i], bv_make_double(i));
+		gphm_set(&g, rhhm_bb_hash, rhhm_bb_cmp, present[i], bv_make_double(i));
+	}
+	for (u32 i = 0; i < 64; i++) hm_get(&r, nil); // finish pending migration
+
+	u32 bad[2] = { 0, 0 }; // hits must find their value, misses nil
+	for (u32 i = 0; i < n; i++) {
+		bv v = bv_make_double(i);
+		bad[0] += hm_get(&r, present[i]).u != v.u || !bv_is_nil(hm_get(&r, absent[i]));
+		bad[1] += gphm_get(&g, rhhm_bb_hash, rhhm_bb_cmp, present[i]).u != v.u ||
+			!bv_is_nil(gphm_get(&g, rhhm_bb_hash, rhhm_bb_cmp, absent[i]));
+	}
+	if (bad[0] || bad[1]) printf("hm load %2u%% wrong lookups  rhhm %u  gphm %u\n", load, bad[0], bad[1]);
+
+	const char *name[] = { "hit", "miss" };
+	bv *keys[] = { present, absent };
+	for (int k = 0; k < 2; k++) {
+		u64 acc = 0, t0, t1, t2;
+
+		t0 = ntime();
+		for (u32 i = 0; i < BENCH_LOOKUPS; i++)
+			acc += hm_get(&r, keys[k][i % n]).u;
+		t1 = ntime();
+		for (u32 i = 0; i < BENCH_LOOKUPS; i++)
+			acc += gphm_get(&g, rhhm_bb_hash, rhhm_bb_cmp, keys[k][i % n]).u;
+		t2 = ntime();
+		sink = acc;
+
+		printf("hm load %2u%% %-4s  rhhm %6.2f ns  gphm %6.2f ns  x%.2f\n", load, name[k],
+			(double)(t1-t0) / BENCH_LOOKUPS, (double)(t2-t1) / BENCH_LOOKUPS,
+			(double)(t1-t0) / (t2-t1));
+	}
+
+	rhhm_destroy(&r);
+	gphm_destroy(&g);
+	ML_FREE(present);
+	ML_FREE(absent);
+}
+
+/* lexer throughput on generated source */
+#define BENCH_SRC (16<<20)
+
+static const char *bench_lines[] = {
+	"local config_value_%u = { name = \"item_%u\", weight = %u.25, enabled = true }\n",
+	"-- generated entry %u, do not edit by hand\n",
+	"function handler_%u(a, b) if a >= b then return a * 2 + b else return nil end end\n",
+	"\tresults[%u] = compute(results[%u - 1], 1.5e3) .. \"suffix\"   \n",
+};
+
+static void bench_lex() {
+	char *src = ML_MALLOC(BENCH_SRC + 256);
+	u32 n = 0;
+	for (u32 i = 0; n < BENCH_SRC; i++)
+		n += sprintf(src + n, bench_lines[xorshift() % 4], i, i, i);
+	src[n] = 0;
+
+	u64 best = (u64)-1, ntok = 0;
+	for (int r = 0; r < 5; r++) {
+		token t;
+		char *s = src;
+		u64 t0 = ntime();
+		for (ntok = 0; !lex(s, &t); ntok++) s = t.s + t.length;
+		u64 t1 = ntime();
+		if (*t.s) printf("lex error @ %ld\n", t.s - src);
+		if (t1 - t0 < best) best = t1 - t0;
+	}
+	printf("lex %u KB  %lu tokens  %.1f MB/s\n", n >> 10, ntok, n / 1e6 / (best / 1e9));
+	ML_FREE(src);
+}
+
+/* number literals: num_parse on the spans vs strtod */
+#define BENCH_NUMS (1<<20)
+
+static void bench_num() {
+	char *src = ML_MALLOC(BENCH_NUMS * 32);
+	u32 *at = ML_MALLOC((BENCH_NUMS + 1) * sizeof(u32)), n = 0;
+	for (u32 i = 0; i < BENCH_NUMS; i++) {
+		at[i] = n;
+		u64 r = xorshift();
+		switch (r % 4) {
+		case 0: n += sprintf(src + n, "%u", (u32)(r >> 40)); break;
+		case 1: n += sprintf(src + n, "%u.%02u", (u32)(r >> 50), (u32)(r >> 8) % 100); break;
+		case 2: n += sprintf(src + n, "%.17g", (double)(r >> 11) / (1 << 20)); break;
+		case 3: n += sprintf(src + n, "%ue%d", (u32)(r >> 44), (int)(r >> 8) % 300 - 150); break;
+		}
+		src[n++] = ' ';
+	}
+	at[BENCH_NUMS] = n;
+
+	u32 bad = 0;
+	for (u32 i = 0; i < BENCH_NUMS; i++) {
+		double d = 0, e = strtod(src + at[i], NULL);
+		int len = at[i+1] - at[i] - 1;
+		if ((num_parse(src + at[i], len, &d) || d != e) && !bad++)
+			printf("num mismatch @ %u '%.*s': %.17g, strtod %.17g\n", at[i], len, src + at[i], d, e);
+	}
+	if (bad) printf("num %u mismatches\n", bad);
+
+	u64 best[2] = { -1, -1 };
+	double acc = 0;
+	for (int r = 0; r < 5; r++) {
+		double d;
+		u64 t0 = ntime();
+		for (u32 i = 0; i < BENCH_NUMS; i++) {
+			num_parse(src + at[i], at[i+1] - at[i] - 1, &d);
+			acc += d;
+		}
+		u64 t1 = ntime();
+		for (u32 i = 0; i < BENCH_NUMS; i++) acc -= strtod(src + at[i], NULL);
+		u64 t2 = ntime();
+		if (t1 - t0 < best[0]) best[0] = t1 - t0;
+		if (t2 - t1 < best[1]) best[1] = t2 - t1;
+	}
+	sink = acc;
+	printf("num %u KB  num_parse %.1f MB/s  strtod %.1f MB/s  x%.2f\n", n >> 10,
+		n / 1e6 / (best[0] / 1e9), n / 1e6 / (best[1] / 1e9), (double)best[1] / best[0]);
+	ML_FREE(src);
+	ML_FREE(at);
+}
+
+int main(int argc, char *argv[]) {
+	bench_lex();
+	bench_num();
+	bench_hm(50);
+	bench_hm(75);
+	bench_hm(85);
+	return 0;
+}
@@ -9,6 +9,8 @@
 
 #include <sys/mman.h>
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -26,17 +28,22 @@ enum cc_reg_xmm {
 typedef struct {
 	u8 *s;
 	u8 *p;
+	size_t sz;
 
-	void *op_addr[IR_OP_MAX];
+	void **op_addr; // per op, from the ir's scratch
 
-	void *fill[IR_OP_MAX];
+	void **fill; // one per forward jump
 	int ifill;
 } cc;
 
-#define CC_BLOCK_SZ (1<<14)
+// code of a chunk is mapped at CC_BLOCK_SZ plus CC_OP_SZ per op, pages
+// are only touched as emitted and cc_done unmaps the rest
+#define CC_BLOCK_SZ (1<<16)
+#define CC_OP_SZ 512
 
-int cc_init(cc *c) {
-	c->s = c->p = mmap(0, CC_BLOCK_SZ,
+int cc_init(cc *c, int nops) {
+	c->sz = CC_BLOCK_SZ + (size_t)nops * CC_OP_SZ;
+	c->s = c->p = mmap(0, c->sz,
 		PROT_READ | PROT_WRITE,
 		MAP_PRIVATE | MAP_ANONYMOUS
 #ifdef linux
@@ -49,7 +56,7 @@ int cc_init(cc *c) {
 }
 
 void cc_destroy(cc *c) {
-	munmap(c->s, CC_BLOCK_SZ);
+	munmap(c->s, c->sz);
 }
 
 u8 *cc_cur(cc *c) { return c->p; }
@@ -77,7 +84,10 @@ void* cc_done(cc *c) {
 	fclose(fp);
 #endif
 
-	return mprotect(c->s, CC_BLOCK_SZ, PROT_READ | PROT_EXEC) == -1 ? NULL : c->s;
+	size_t used = (c->p - c->s + 4095) & ~(size_t)4095;
+	if (used < c->sz) munmap(c->s + used, c->sz - used);
+	c->sz = used;
+	return mprotect(c->s, c->sz, PROT_READ | PROT_EXEC) == -1 ? NULL : c->s;
 }
 
 
@@ -105,6 +115,7 @@ void* cc_done(cc *c) {
 
 
 void cc_xor_rr(cc *c, i32 a, i32 b);
+void cc_mcode(cc *c, u8 *mcode, u32 sz);
 void cc_mov_rl(cc *c, i32 reg, bv v) { // mov $reg, $v
 	if (v.u == 0) {
 		cc_xor_rr(c, reg, reg);
@@ -195,6 +206,129 @@ void cc_test_rr(cc *c, i32 dest, i32 src) {
 	*c->p++ = MODRM(0x3, src, dest);
 }
 
+void cc_and_rr(cc *c, i32 dest, i32 src) {
+	*c->p++ = REX(1, src, 0, dest);
+	*c->p++ = 0x21;
+	*c->p++ = MODRM(0x3, src, dest);
+}
+
+void cc_add_rr(cc *c, i32 dest, i32 src) {
+	*c->p++ = REX(1, src, 0, dest);
+	*c->p++ = 0x01;
+	*c->p++ = MODRM(0x3, src, dest);
+}
+
+void cc_or_rr(cc *c, i32 dest, i32 src) {
+	*c->p++ = REX(1, src, 0, dest);
+	*c->p++ = 0x09;
+	*c->p++ = MODRM(0x3, src, dest);
+}
+
+void cc_shl_ri(cc *c, i32 reg, u8 n) {
+	*c->p++ = REX(1, 0, 0, reg);
+	*c->p++ = 0xc1;
+	*c->p++ = MODRM(0x3, 4, reg);
+	*c->p++ = n;
+}
+
+void cc_shr_ri(cc *c, i32 reg, u8 n) {
+	*c->p++ = REX(1, 0, 0, reg);
+	*c->p++ = 0xc1;
+	*c->p++ = MODRM(0x3, 5, reg);
+	*c->p++ = n;
+}
+
+void cc_dec(cc *c, i32 reg) {
+	*c->p++ = REX(1, 0, 0, reg);
+	*c->p++ = 0xff;
+	*c->p++ = MODRM(0x3, 1, reg);
+}
+
+void cc_mov_rm(cc *c, i32 dest, i32 base, i32 disp) { // mov $dest, [$base+$disp]
+	EMIT_REX(1, dest, base);
+	EMIT_OPCODE(0x8b);
+	EMIT_MODRM(0x2, dest, base);
+	if ((base & 0x7) == rsp) EMIT_SIB();
+	EMIT_I32(disp);
+}
+
+void cc_mov_mr(cc *c, i32 base, i32 disp, i32 src) { // mov [$base+$disp], $src
+	EMIT_REX(1, src, base);
+	EMIT_OPCODE(0x89);
+	EMIT_MODRM(0x2, src, base);
+	if ((base & 0x7) == rsp) EMIT_SIB();
+	EMIT_I32(disp);
+}
+
+void cc_mov32_mr(cc *c, i32 base, i32 disp, i32 src) { // mov [$base+$disp], $src32
+	if (src >= r8 || base >= r8) EMIT_REX(0, src, base);
+	EMIT_OPCODE(0x89);
+	EMIT_MODRM(0x2, src, base);
+	if ((base & 0x7) == rsp) EMIT_SIB();
+	EMIT_I32(disp);
+}
+
+void cc_test32_mi(cc *c, i32 base, i32 disp, i32 imm) { // test dword [$base+$disp], $imm
+	if (base >= r8) EMIT_REX(0, 0, base);
+	EMIT_OPCODE(0xf7);
+	EMIT_MODRM(0x2, 0, base);
+	if ((base & 0x7) == rsp) EMIT_SIB();
+	EMIT_I32(disp);
+	EMIT_I32(imm);
+}
+
+void cc_lea_rm(cc *c, i32 dest, i32 base, i32 disp) { // lea $dest, [$base+$disp]
+	EMIT_REX(1, dest, base);
+	EMIT_OPCODE(0x8d);
+	EMIT_MODRM(0x2, dest, base);
+	if ((base & 0x7) == rsp) EMIT_SIB();
+	EMIT_I32(disp);
+}
+
+void cc_mov32_rm(cc *c, i32 dest, i32 base, i32 disp) { // mov $dest32, [$base+$disp]
+	if (dest >= r8 || base >= r8) EMIT_REX(0, dest, base);
+	EMIT_OPCODE(0x8b);
+	EMIT_MODRM(0x2, dest, base);
+	if ((base & 0x7) == rsp) EMIT_SIB();
+	EMIT_I32(disp);
+}
+
+// base can't be rbp/r13 (no displacement)
+void cc_mov_ri8(cc *c, i32 dest, i32 base, i32 index) { // mov $dest, [$base+$index*8]
+	*c->p++ = REX(1, dest, ((index & 0x8) >> 3), base);
+	*c->p++ = 0x8b;
+	*c->p++ = MODRM(0x0, dest, rsp);
+	*c->p++ = (0x3 << 6) | ((index & 0x7) << 3) | (base & 0x7);
+}
+
+void cc_mov_i8r(cc *c, i32 base, i32 index, i32 src) { // mov [$base+$index*8], $src
+	*c->p++ = REX(1, src, ((index & 0x8) >> 3), base);
+	*c->p++ = 0x89;
+	*c->p++ = MODRM(0x0, src, rsp);
+	*c->p++ = (0x3 << 6) | ((index & 0x7) << 3) | (base & 0x7);
+}
+
+void cc_cvttsd2si(cc *c, i32 dest, i32 src) { // $dest <- (i64)$src
+	*c->p++ = 0xf2;
+	*c->p++ = REX(1, dest, 0, src);
+	*c->p++ = 0x0f;
+	*c->p++ = 0x2c;
+	*c->p++ = MODRM(0x3, dest, src);
+}
+
+void cc_cvtsi2sd(cc *c, i32 dest, i32 src) { // $dest <- (double)$src
+	*c->p++ = 0xf2;
+	*c->p++ = REX(1, dest, 0, src);
+	*c->p++ = 0x0f;
+	*c->p++ = 0x2a;
+	*c->p++ = MODRM(0x3, dest, src);
+}
+
+void cc_ucomisd(cc *c, i32 a, i32 b) {
+	cc_mcode(c, (u8*)"\x66\x0f\x2e", 3);
+	*c->p++ = MODRM(0x3, a, b);
+}
+
 void cc_call(cc *c, void *f) {
 	*c->p = 0xe8; // call
 	i32 offset =  (u8*)f - (u8*)(c->p+5);
@@ -225,6 +359,24 @@ void cc_jnz(cc *c, void *f) {
 	c->p+=6;
 }
 
+enum cc_cond {
+	CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_P = 0xa
+};
+
+void cc_jcc(cc *c, u8 cond, void *f) {
+	*c->p = 0x0f;
+	c->p[1] = 0x80 | cond;
+	i32 offset =  (u8*)f - (u8*)(c->p+6);
+	memcpy(c->p+2, &offset, sizeof(i32));
+	c->p+=6;
+}
+
+// point the rel32 jump ending at jmp_end to the current position
+void cc_label(cc *c, u8 *jmp_end) {
+	i32 offset = c->p - jmp_end;
+	memcpy(jmp_end-4, &offset, sizeof(i32));
+}
+
 void cc_mcode(cc *c, u8 *mcode, u32 sz) {
 	memcpy(c->p, mcode, sz);
 	c->p+=sz;
@@ -298,12 +450,18 @@ static int allocate_cmp(const void* a, const void* b) {
     return ai > bi ? 1 : 0;
 }
 
+// ini and end have liveness_sz(c) entries, ini is sorted with unused vars last
+static int liveness_sz(ir *c) {
+	return (vsize(c->ops) > c->iv ? vsize(c->ops) : c->iv) + 1;
+}
+
 static void liveness(ir *c, u32 *ini, u32 *end) {
 	prof_begin("liveness_Z");
 
-	u8 loop_depth[IR_OP_MAX] = {0};
+	ir_scratch s = ir_scratch_save(c);
+	u8 *loop_depth = ir_alloc(c, vsize(c->ops) + 1);
 
-	for (int i = 0; i < vsize(c->ops); i++) ini[i] = end[i] = (u32)-1;
+	for (int i = 0; i < liveness_sz(c); i++) ini[i] = end[i] = (u32)-1;
 	prof_end();
 	prof_begin("livenessI");
 	for (int i = vsize(c->ops)-1; i >= 0; i--) {
@@ -327,13 +485,15 @@ static void liveness(ir *c, u32 *ini, u32 *end) {
 		int b = vget(c->ops, i).b;
 
 		if (a >= 0 && a != IR_NO_ARG) end[a] = i;
-		if (b >= 0 && b != IR_NO_ARG && op != IR_OP_CALL) end[b] = i;
+		if (b >= 0 && b != IR_NO_ARG && !ir_b_is_count(op)) end[b] = i;
+		if (op == IR_OP_TSTORE) end[vget(c->ops, i).target] = i; // table is used
 	}
 
 	prof_end();
 
 	prof_begin("live ext");
 	for (int j = 0; j < c->iv; j++) { // extend live ranges
+			if (ini[j] == (u32)-1 || end[j] == (u32)-1) continue; // unused
 			int b = ini[j] >> 16;
 			int e = end[j];
 
@@ -366,9 +526,10 @@ static void liveness(ir *c, u32 *ini, u32 *end) {
 
 	prof_begin("live sort");
 
-	qsort(ini, vsize(c->ops), sizeof(int), allocate_cmp);
+	qsort(ini, liveness_sz(c), sizeof(int), allocate_cmp);
 
 	prof_end();
+	ir_scratch_restore(c, s);
 }
 
 // [ir_begin, ir_end)
@@ -383,7 +544,7 @@ static void allocate(ir *c,
 	int current[nregs];
 	int used = 0;
 	int spills = 0;
-	for (int i = 0; i < vsize(c->ops) + 1; i++) {
+	for (int i = 0; i < liveness_sz(c) && ini[i] != (u32)-1; i++) {
 		int var = ini[i]&0xffff;
 		int var_ini = ini[i]>>16;
 		int var_end = end[var];
@@ -449,6 +610,282 @@ static void allocate(ir *c,
 	prof_end();
 }
 
+/* table array part fast path */
+#define CC_MAX_SLOW 4
+
+// can fld index the array part? constants must be positive integers
+static int cc_array_key(ir *o, int fld) {
+	if (fld >= 0) return 1;
+	bv k = vget(o->ctts, -fld-1);
+	return bv_is_double(k) && k.d >= 1 && k.d == (u32)k.d;
+}
+
+// rax <- array index of $key, unless it is not an integer in [1, array.sz];
+// $tbl holds the unboxed table, returns no. of jumps to the slow path
+static int cc_array_index(cc *c, i32 tbl, i32 key, u8 **slow) {
+	int n = 0;
+	cc_movq_xr(c, xmm0, key);
+	cc_cvttsd2si(c, rax, xmm0);
+	cc_cvtsi2sd(c, xmm1, rax);
+	cc_ucomisd(c, xmm0, xmm1);
+	cc_jcc(c, CC_P, NULL); // not a number
+	slow[n++] = cc_cur(c);
+	cc_jcc(c, CC_NE, NULL); // not an integer
+	slow[n++] = cc_cur(c);
+	cc_dec(c, rax);
+	cc_mov32_rm(c, r9, tbl, offsetof(table, array.sz));
+	cc_cmp_rr(c, rax, r9);
+	cc_jcc(c, CC_AE, NULL); // out of range, also catches i < 1
+	slow[n++] = cc_cur(c);
+	return n;
+}
+
+/* inline caches */
+// constant string key, read through a per site ic
+static int cc_ic_key(ir *o, int fld) {
+	return fld < 0 && shape_is_key(vget(o->ctts, -fld-1));
+}
+
+static ic *cc_ic_alloc(ir *o, int begin, int end) {
+	int n = 0;
+	for (int i = begin; i < end; i++) {
+		tac *t = vbegin(o->ops)+i;
+		if ((t->op == IR_OP_TLOAD && cc_ic_key(o, t->b)) ||
+			(t->op == IR_OP_TSTORE && cc_ic_key(o, t->a))) n++;
+	}
+	if (!n) return NULL;
+
+	ic *ics = ML_MALLOC(n * sizeof(ic)); // lives as long as the code
+	if (!ics) return NULL;
+	for (int i = 0; i < n; i++) ics[i].shape = SHAPE_NONE;
+	return ics;
+}
+
+// jumps to the slow path unless the shape of table $tbl matches ic $cell,
+// then loads the slot array to $tbl and the slot to r10
+static u8 *cc_ic_check(cc *c, i32 tbl, i32 cell) {
+	cc_mov_rm(c, r9, tbl, offsetof(table, shape));
+	cc_mov_rm(c, r10, cell, offsetof(ic, shape));
+	cc_cmp_rr(c, r9, r10);
+	cc_jcc(c, CC_NE, NULL);
+	u8 *slow = cc_cur(c);
+	cc_mov_rm(c, r10, cell, offsetof(ic, slot));
+	cc_mov_rm(c, tbl, tbl, offsetof(table, slots));
+	return slow;
+}
+
+// copies the values of the nargs IR_OP_ARG before t to [rsp], returns the
+// no. of stack slots reserved (kept 16B aligned)
+static int cc_push_args(cc *c, ir *o, tac *t, int nargs, int *assignment) {
+	int align = nargs + (nargs & 1 ? 1 : 0);
+	i32 ra;
+
+	if (nargs) cc_subrsp(c, sizeof(bv)*align);
+	for (int j = 0; j < nargs; j++) {
+		tac *arg = t-j-1;
+		if (arg->a >= 0) {
+			ra = assignment[arg->a];
+			if (ra < 0) { // on stack
+				cc_mov_rs(c, rax, -ra-1 + align);
+				ra = rax;
+			}
+		} else { // constant
+			cc_mov_rl(c, rax, vget(o->ctts, -arg->a-1));
+			ra = rax;
+		}
+		cc_mov_sr(c, nargs-j-1, ra);
+	}
+	return align;
+}
+
+static void cc_unbox_tbl(cc *c, i32 dest, i32 src) {
+	bv mask; mask.u = bv_value_mask;
+	cc_mov_rl(c, dest, mask);
+	cc_and_rr(c, dest, src);
+}
+
+/* gc write barrier */
+// jumps unless $val has $tag. Clobbers rax, rdi
+static u8 *cc_skip_not(cc *c, i32 val, u64 tag) {
+	bv t; t.u = tag >> 48;
+	cc_mov_rr(c, rax, val);
+	cc_shr_ri(c, rax, 48);
+	cc_mov_rl(c, rdi, t);
+	cc_cmp_rr(c, rax, rdi);
+	cc_jcc(c, CC_NE, NULL);
+	return cc_cur(c);
+}
+
+// after storing $val to the table boxed in $tbl, call gc_barrier if $val is
+// a table and the table is old or black, gc_barrier_root if $val is a long
+// string and the table is black. Clobbers rax, rsi, rdi and may call out
+static void cc_barrier(cc *c, i32 tbl, i32 val, i32 lvar) {
+	u8 *skip[4];
+	skip[0] = cc_skip_not(c, val, bv_tbl);
+	cc_unbox_tbl(c, rax, tbl);
+	cc_test32_mi(c, rax, offsetof(table, gcflags), GC_BARRIER | GC_BLACK);
+	cc_jcc(c, CC_E, NULL);
+	skip[1] = cc_cur(c);
+	cc_mov_rr(c, rsi, rax);
+	cc_mov_rs(c, rdi, lvar);
+	cc_lea_rm(c, rdi, rdi, offsetof(state, gc));
+	cc_call(c, (void*)gc_barrier);
+	cc_jmp(c, NULL);
+	skip[2] = cc_cur(c);
+
+	cc_label(c, skip[0]);
+	skip[0] = cc_skip_not(c, val, bv_str);
+	cc_unbox_tbl(c, rax, tbl);
+	cc_test32_mi(c, rax, offsetof(table, gcflags), GC_BLACK);
+	cc_jcc(c, CC_E, NULL);
+	skip[3] = cc_cur(c);
+	cc_mov_rr(c, rsi, val);
+	cc_mov_rs(c, rdi, lvar);
+	cc_lea_rm(c, rdi, rdi, offsetof(state, gc));
+	cc_call(c, (void*)gc_barrier_root);
+	for (int i = 0; i < 4; i++) cc_label(c, skip[i]);
+}
+
+// after storing $val to a global cell, mark it while a cycle is marking
+static void cc_barrier_root(cc *c, i32 val, i32 lvar) {
+	u8 *skip[3], *mark;
+	skip[0] = cc_skip_not(c, val, bv_str);
+	cc_jmp(c, NULL);
+	mark = cc_cur(c);
+	cc_label(c, skip[0]);
+	skip[0] = cc_skip_not(c, val, bv_tbl);
+	cc_label(c, mark);
+	cc_mov_rs(c, rdi, lvar);
+	cc_test32_mi(c, rdi, offsetof(state, gc.phase), GC_MARK);
+	cc_jcc(c, CC_E, NULL);
+	skip[1] = cc_cur(c);
+	cc_lea_rm(c, rdi, rdi, offsetof(state, gc));
+	cc_mov_rr(c, rsi, val);
+	cc_call(c, (void*)gc_barrier_root);
+	cc_label(c, skip[0]);
+	cc_label(c, skip[1]);
+}
+
+/* stack maps, shared by the states of all threads */
+static rhhm stackmaps; // return address -> stackmap
+static pthread_mutex_t stackmaps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the map outlives the states, like the code, its payloads are malloc'd
+static ml_allocator stackmaps_enter() {
+	ml_allocator a = ml_payload;
+	ml_payload = ml_malloc_allocator;
+	pthread_mutex_lock(&stackmaps_lock);
+	return a;
+}
+
+static void stackmaps_leave(ml_allocator a) {
+	pthread_mutex_unlock(&stackmaps_lock);
+	ml_payload = a;
+}
+
+stackmap *cc_stackmap(void *ra) {
+	bv k, m = nil; k.p = ra;
+	ml_allocator a = stackmaps_enter(); // lookups migrate too
+	if (stackmaps.data) m = hm_get(&stackmaps, k);
+	stackmaps_leave(a);
+	return bv_is_nil(m) ? NULL : m.p;
+}
+
+// vars defined in [lo, i) and used after op i, at most max
+static int cc_live(ir *o, int lo, int i, u32 *liv_ini, u32 *liv_end, int *live, int max) {
+	int n = 0;
+	for (int j = 0; j < vsize(o->ops) && (int)(liv_ini[j] >> 16) < i && n < max; j++) {
+		int var = liv_ini[j] & 0xffff;
+		if ((int)(liv_ini[j] >> 16) < lo) continue;
+		if (liv_end[var] == (u32)-1 || (int)liv_end[var] <= i) continue;
+		live[n++] = var;
+	}
+	return n;
+}
+
+// frame slot of $var, callee saved registers have one each at $sregs
+static int cc_live_slot(int var, int *assignment, int *regs, int sregs) {
+	int a = assignment[var], k = 0;
+	if (a < 0) return -a-1;
+	while (regs[k] != a) k++;
+	return sregs + k;
+}
+
+// callee saved registers holding live values are stored to the frame before
+// a call that may collect and loaded back after it, C callees may save them
+// anywhere
+static void cc_save_live(cc *c, int *live, int n, int *assignment, int *regs, int sregs, int load) {
+	for (int j = 0; j < n; j++) {
+		int a = assignment[live[j]];
+		if (a < 0) continue;
+		if (load) cc_mov_rs(c, a, cc_live_slot(live[j], assignment, regs, sregs));
+		else cc_mov_sr(c, cc_live_slot(live[j], assignment, regs, sregs), a);
+	}
+}
+
+// right after a call, $nargs values pushed by cc_push_args are roots too
+static void cc_stackmap_add(cc *c, int *live, int n, int *assignment, int *regs, int sregs,
+	int frame, int nargs, int align) {
+	stackmap *m = ML_MALLOC(sizeof(stackmap) + (n + nargs) * sizeof(u16));
+	if (!m) abort(); // a lost map hides the roots of every caller
+	m->frame = frame + align;
+	m->n = 0;
+	for (int j = 0; j < nargs; j++) m->slot[m->n++] = j;
+	for (int j = 0; j < n; j++)
+		m->slot[m->n++] = align + cc_live_slot(live[j], assignment, regs, sregs);
+
+	bv k, v; k.p = cc_cur(c); v.p = m;
+	ml_allocator a = stackmaps_enter();
+	int r = (!stackmaps.data && rhhm_init(&stackmaps, 64, 0)) || hm_set(&stackmaps, k, v);
+	stackmaps_leave(a);
+	if (r) abort();
+}
+
+/* table allocation fast path */
+// rax <- new boxed table bumped from the semispace, same header as
+// lua_createtable(L, 0, n) with hash part hcap. $l holds L, returns the jump
+// taken when the space is full
+static u8 *cc_newtbl(cc *c, i32 l, u32 hcap) {
+	bv v;
+	cc_mov_rm(c, rax, l, offsetof(state, gc.cur));
+	cc_mov_rm(c, rcx, l, offsetof(state, gc.end));
+	cc_cmp_rr(c, rax, rcx);
+	cc_jcc(c, CC_AE, NULL);
+	u8 *slow = cc_cur(c);
+	cc_lea_rm(c, rcx, rax, sizeof(table));
+	cc_mov_mr(c, l, offsetof(state, gc.cur), rcx);
+
+	// L->seed = seed*33 + (u32)(t ^ t>>32), low 32 bits only
+	cc_mov32_rm(c, rdx, l, offsetof(state, seed));
+	cc_mov_rr(c, rcx, rdx);
+	cc_shl_ri(c, rcx, 5);
+	cc_add_rr(c, rcx, rdx);
+	cc_mov_rr(c, rsi, rax);
+	cc_shr_ri(c, rsi, 32);
+	cc_xor_rr(c, rsi, rax);
+	cc_add_rr(c, rcx, rsi);
+	cc_mov32_mr(c, l, offsetof(state, seed), rcx);
+
+	cc_shl_ri(c, rcx, 32);
+	v.p = RHHM_LAZY(hcap, 0);
+	cc_mov_rl(c, rsi, v);
+	cc_or_rr(c, rcx, rsi);
+	cc_mov_mr(c, rax, offsetof(table, hash), rcx);
+
+	cc_xor_rr(c, rcx, rcx);
+	cc_mov32_mr(c, rax, offsetof(table, gcflags), rcx); // young
+	cc_mov_mr(c, rax, offsetof(table, array.data), rcx);
+	cc_mov_mr(c, rax, offsetof(table, array.cap), rcx); // cap and sz
+	cc_mov_mr(c, rax, offsetof(table, slots), rcx);
+	cc_mov_rm(c, rcx, l, offsetof(state, shape_root));
+	cc_mov_mr(c, rax, offsetof(table, shape), rcx);
+
+	v.u = bv_tbl;
+	cc_mov_rl(c, rcx, v);
+	cc_or_rr(c, rax, rcx);
+	return slow;
+}
+
 /**********************************************************/
 /* IR compiler                                            */
 /**********************************************************/
@@ -495,7 +932,8 @@ static void allocate(ir *c,
 
 static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end) {
 	int regs[] = { rbx, rbp, r12, r13, r14, r15 };
-	int assignment[IR_OP_MAX] = {0};
+	ir_scratch s = ir_scratch_save(o);
+	int *assignment = ir_alloc(o, o->iv * sizeof(int));
 	int spills;
 	int allocated;
 
@@ -522,6 +960,8 @@ static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end
 	// assemble
 	int nvars = spills;
 	int lvar = nvars++; // for L, TODO: remove?
+	int sregs = nvars; // callee saved registers across calls, see cc_save_live
+	nvars += allocated;
 
 #ifdef DBG
 	printf("L var stack:  %d\n", lvar);
@@ -551,8 +991,17 @@ static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end
 	printf("total ops:  %d\n", vsize(o->ops));
 #endif
 
+	ic *ics = cc_ic_alloc(o, begin, end);
+	int nics = 0;
+
+	int lo = begin, nlive;
+	if (vget(o->ops, begin).op == IR_FUNCTION_BEGIN) lo -= vget(o->ops, begin).b;
+	int live[allocated + spills + begin - lo + 1];
+
 	cc c;
-	cc_init(&c);
+	if (cc_init(&c, end - begin)) abort();
+	c.op_addr = ir_alloc(o, (vsize(o->ops) + 1) * sizeof(void*));
+	c.fill = ir_alloc(o, (end - begin) * sizeof(void*));
 
 	for (int i = 0; i < allocated; i++) cc_push(&c, regs[i]);
 
@@ -562,6 +1011,7 @@ static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end
 
 	int ra, rb;
 	for (int i = begin; i < end; i++) {
+		if (c.p + CC_BLOCK_SZ/2 > c.s + c.sz) abort(); // no single op comes close
 		c.op_addr[i] = cc_cur(&c);
 		tac *t = vbegin(o->ops)+i;
 
@@ -574,28 +1024,31 @@ static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end
 			bv v; v.u = t->b;
 			cc_mov_rl(&c, rsi, v);
 
-			int nargs = t->b;
-			int align = nargs + (nargs & 1 ? 1 : 0);
-
-			if (nargs) cc_subrsp(&c, sizeof(bv)*align);
-			for (int j = 0; j < nargs; j++) {
-				tac *arg = t-j-1;
-				if (arg->a >= 0) {
-					ra = assignment[arg->a];
-					if (ra < 0) { // on stack
-						cc_mov_rs(&c, rax, -ra-1 + align);
-						ra = rax;
-					}
-				} else { // constant
-					cc_mov_rl(&c, rax, vget(o->ctts, -arg->a-1));
-					ra = rax;
-				}
-				cc_mov_sr(&c, nargs-j-1, ra);
-			}
+			nlive = cc_live(o, lo, i, liv_ini, liv_end, live, sizeof(live)/sizeof(int));
+			cc_save_live(&c, live, nlive, assignment, regs, sregs, 0);
+			int align = cc_push_args(&c, o, t, t->b, assignment);
+			cc_mov_mr(&c, rdi, offsetof(state, sp), rsp);
 			cc_call(&c, ml_indirect_call);
-			if (nargs) cc_addrsp(&c, sizeof(bv)*align);
+			cc_stackmap_add(&c, live, nlive, assignment, regs, sregs, nvars + allocated, t->b, align);
+			if (align) cc_addrsp(&c, sizeof(bv)*align);
+			cc_save_live(&c, live, nlive, assignment, regs, sregs, 1);
 			SAVE_RESULT(t->target);
 			} break;
+		case IR_OP_TSETLIST: { // a: table, b: number of values, preceded by the first index
+			int nargs = t->b;
+
+			LOAD_A(rsi);
+			cc_mov_rs(&c, rdi, lvar);
+			bv v; v.u = (u32)vget(o->ctts, -t[-nargs-1].a-1).d;
+			cc_mov_rl(&c, rdx, v);
+			v.u = nargs;
+			cc_mov_rl(&c, rcx, v);
+
+			int align = cc_push_args(&c, o, t, nargs, assignment);
+			cc_mov_rr(&c, r8, rsp);
+			cc_call(&c, (void*)lua_setlist);
+			if (align) cc_addrsp(&c, sizeof(bv)*align);
+			} break;
 		case IR_OP_JE: // cmp + jmp
 			LOAD_RA_RB();
 			cc_cmp_rr(&c, ra, rb);
@@ -650,57 +1103,131 @@ static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end
 				cc_mark(&c, t->target);
 			}
 			break;
-		case IR_OP_NEWTBL:
+		case IR_OP_NEWTBL: { // a: array size, b: hash size, if not IR_NO_ARG
+			u32 narr = t->a == IR_NO_ARG ? 0 : vget(o->ctts, -t->a-1).d;
+			u32 nhash = t->b == IR_NO_ARG ? 0 : vget(o->ctts, -t->b-1).d;
+			u8 *slow = NULL, *done = NULL;
 			cc_mov_rs(&c, rdi, lvar);
-			cc_call(&c, (void*)lua_newtable);
+			if (!narr) { // else the array part is malloc'd anyway
+				slow = cc_newtbl(&c, rdi, table_hash_cap(nhash));
+				cc_jmp(&c, NULL);
+				done = cc_cur(&c);
+				cc_label(&c, slow);
+			}
+			bv v; v.u = narr;
+			cc_mov_rl(&c, rsi, v);
+			v.u = nhash;
+			cc_mov_rl(&c, rdx, v);
+			nlive = cc_live(o, lo, i, liv_ini, liv_end, live, sizeof(live)/sizeof(int));
+			cc_save_live(&c, live, nlive, assignment, regs, sregs, 0);
+			cc_mov_mr(&c, rdi, offsetof(state, sp), rsp);
+			cc_call(&c, (void*)lua_createtable); // may collect or grow the heap
+			cc_stackmap_add(&c, live, nlive, assignment, regs, sregs, nvars + allocated, 0, 0);
+			cc_save_live(&c, live, nlive, assignment, regs, sregs, 1);
+			if (done) cc_label(&c, done);
 			SAVE_RESULT(t->target);
-			break;
-		case IR_OP_TSTORE:
-			cc_mov_rs(&c, rdi, lvar);
-			cc_mov_rs(&c, rsi, t->target);
-
-			if (t->a < 0) cc_mov_rl(&c, rdx, vget(o->ctts, -t->a-1));
-			else cc_mov_rs(&c, rdx, t->a);
+			} break;
+		case IR_OP_TSTORE: { // a: key, b: value, target: table
+			u8 *slow[CC_MAX_SLOW], *done = NULL;
+			int nslow;
+
+			LOAD(t->target, rsi, ra);
+			LOAD_A(rdx);
+			LOAD_B(rcx);
+
+			if (ics && cc_ic_key(o, t->a)) {
+				bv cell; cell.p = ics + nics++;
+				cc_unbox_tbl(&c, r8, rsi);
+				cc_mov_rl(&c, rax, cell);
+				slow[0] = cc_ic_check(&c, r8, rax);
+				cc_mov_i8r(&c, r8, r10, rcx);
+				cc_barrier(&c, rsi, rcx, lvar);
+				cc_jmp(&c, NULL);
+				done = cc_cur(&c);
+				cc_label(&c, slow[0]);
 
-			if (t->b < 0) cc_mov_rl(&c, rcx, vget(o->ctts, -t->b-1));
-			else cc_mov_rs(&c, rcx, t->b);
+				cc_mov_rr(&c, r8, rax);
+				cc_mov_rs(&c, rdi, lvar);
+				cc_call(&c, (void*)lua_setfield_ic);
+				cc_label(&c, done);
+				break;
+			}
 
-			cc_call(&c, (void*)lua_setfield);
+			if (cc_array_key(o, t->a) &&
+				!(t->b < 0 && bv_is_nil(vget(o->ctts, -t->b-1)))) {
+				cc_unbox_tbl(&c, r8, rsi);
+				nslow = cc_array_index(&c, r8, rdx, slow);
+				cc_mov_rl(&c, r9, nil); // nil may move the border
+				cc_cmp_rr(&c, rcx, r9);
+				cc_jcc(&c, CC_E, NULL);
+				slow[nslow++] = cc_cur(&c);
+				cc_mov_rm(&c, r8, r8, offsetof(table, array.data));
+				cc_mov_i8r(&c, r8, rax, rcx);
+				cc_barrier(&c, rsi, rcx, lvar);
+				cc_jmp(&c, NULL);
+				done = cc_cur(&c);
+				while (nslow) cc_label(&c, slow[--nslow]);
+			}
 
-			break;
-		case IR_OP_TLOAD:
 			cc_mov_rs(&c, rdi, lvar);
+			cc_call(&c, (void*)lua_setfield);
+			if (done) cc_label(&c, done);
+			} break;
+		case IR_OP_TLOAD: { // a: table, b: key
+			u8 *slow[CC_MAX_SLOW], *done = NULL;
+			int nslow;
 
 			LOAD_A(rsi);
 			LOAD_B(rdx);
 
-			if (ra != rsi) cc_mov_rr(&c, rsi, ra);
-			if (rb != rdx) cc_mov_rr(&c, rdx, rb);
-
-			cc_call(&c, (void*)lua_getfield);
-
-			SAVE_RESULT(t->target);
-			break;
-		case IR_OP_GSTORE:
-			cc_mov_rs(&c, rdi, lvar);
+			if (ics && cc_ic_key(o, t->b)) {
+				bv cell; cell.p = ics + nics++;
+				cc_unbox_tbl(&c, r8, rsi);
+				cc_mov_rl(&c, rcx, cell);
+				slow[0] = cc_ic_check(&c, r8, rcx);
+				cc_mov_ri8(&c, rax, r8, r10);
+				cc_jmp(&c, NULL);
+				done = cc_cur(&c);
+				cc_label(&c, slow[0]);
 
-			LOAD_A(rsi);
-			LOAD_B(rdx);
+				cc_mov_rs(&c, rdi, lvar);
+				cc_call(&c, (void*)lua_getfield_ic);
+				cc_label(&c, done);
+				SAVE_RESULT(t->target);
+				break;
+			}
 
-			if (ra != rsi) cc_mov_rr(&c, rsi, ra);
-			if (rb != rdx) cc_mov_rr(&c, rdx, rb);
+			if (cc_array_key(o, t->b)) {
+				cc_unbox_tbl(&c, r8, rsi);
+				nslow = cc_array_index(&c, r8, rdx, slow);
+				cc_mov_rm(&c, r8, r8, offsetof(table, array.data));
+				cc_mov_ri8(&c, rax, r8, rax);
+				cc_jmp(&c, NULL);
+				done = cc_cur(&c);
+				while (nslow) cc_label(&c, slow[--nslow]);
+			}
 
-			cc_call(&c, (void*)lua_setglobal);
-			break;
-		case IR_OP_GLOAD:
 			cc_mov_rs(&c, rdi, lvar);
+			cc_call(&c, (void*)lua_getfield);
+			if (done) cc_label(&c, done);
 
-			LOAD_A(rsi);
-			if (ra != rsi) cc_mov_rr(&c, rsi, ra);
-
-			cc_call(&c, (void*)lua_getglobal);
+			SAVE_RESULT(t->target);
+			} break;
+		case IR_OP_GSTORE: { // a: global cell, b: value
+			bv cell; cell.p = bv_get_ptr(vget(o->ctts, -t->a-1));
+			LOAD_B(rdx);
+			cc_mov_rl(&c, rax, cell);
+			cc_mov_mr(&c, rax, 0, rdx);
+			if (t->b >= 0 || bv_is_tbl(vget(o->ctts, -t->b-1)))
+				cc_barrier_root(&c, rdx, lvar);
+			} break;
+		case IR_OP_GLOAD: { // a: global cell
+			bv cell; cell.p = bv_get_ptr(vget(o->ctts, -t->a-1));
+			cc_mov_rl(&c, rax, cell);
+			cc_mov_rm(&c, rax, rax, 0);
 
 			SAVE_RESULT(t->target);
+			}
 			break;
 		case IR_OP_LCOPY: {
 			if (assignment[t->target] >= 0) {
@@ -770,6 +1297,7 @@ static void *compile_chunk(ir *o, int begin, int end, u32 *liv_ini, u32 *liv_end
 	if (nvars) cc_addrsp(&c, sizeof(bv)*nvars);
 	for (int i = allocated; i > 0; i--) cc_pop(&c, regs[i-1]);
 	cc_ret(&c);
+	ir_scratch_restore(o, s);
 	return cc_done(&c);
 }
 
@@ -798,8 +1326,8 @@ void *compile(ir *I) {
 	puts("IR:"); ir_disp(I);
 #endif
 
-	u32 liveness_ini[IR_OP_MAX];
-	u32 liveness_end[IR_OP_MAX];
+	u32 *liveness_ini = ir_alloc(I, liveness_sz(I) * sizeof(u32));
+	u32 *liveness_end = ir_alloc(I, liveness_sz(I) * sizeof(u32));
 	liveness(I, liveness_ini, liveness_end);
 
 	prof_begin("comp");
@@ -1,9 +1,24 @@
 #ifndef CC_H
 #define CC_H
 
+#include "common.h"
+
 typedef struct ir ir;
 
 void *compile(ir *I);
 
+/*
+ * Calls out of compiled code that may collect record the stack slots holding
+ * live values, keyed by return address. rsp at the call is kept in L->sp,
+ * from there the GC walks caller frames until a return address is not found.
+ */
+typedef struct stackmap {
+	u32 frame;   // words from rsp at the call to the return address of the function
+	u32 n;
+	u16 slot[1]; // words from rsp at the call
+} stackmap;
+
+stackmap *cc_stackmap(void *ra);
+
 #endif // CC_H
 
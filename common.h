@@ -21,6 +21,29 @@ typedef int8_t  i8;
 #define ML_REALLOC realloc
 #define ML_FREE    free
 
+// lua_Alloc style allocator: frees p when nsize is 0, else resizes p (osize
+// bytes, 0 when p is NULL) to nsize
+typedef void *(*ml_alloc)(void *ud, void *p, size_t osize, size_t nsize);
+void *ml_default_alloc(void *ud, void *p, size_t osize, size_t nsize); // ML_REALLOC
+
+/*
+ * Table payloads (hash and array parts, slots) and shapes are allocated
+ * through ml_payload, owner is the address of the map or vector they belong to
+ * and sizes are passed back on free, so the GC can account for them.
+ * Defaults to ml_malloc_allocator. Each thread has its own: a state installs
+ * its GC's when entered (see gc_enter), which bumps payloads of young tables
+ * and takes the rest from the state's allocator.
+ */
+typedef struct ml_allocator {
+	void *(*alloc)(void *ctx, void *owner, size_t sz);
+	void *(*realloc)(void *ctx, void *owner, void *p, size_t old, size_t sz);
+	void (*free)(void *ctx, void *p, size_t sz);
+	void *ctx;
+} ml_allocator;
+
+extern __thread ml_allocator ml_payload;
+extern const ml_allocator ml_malloc_allocator;
+
 /* bitset */
 #include <string.h>
 
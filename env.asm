@@ -7,15 +7,12 @@ section .data
 section .text
 
     extern lua_error
-    extern lua_gc_impl
 
     global ml_indirect_call
     global ml_indirect_luacall
 
     global ml_get_rsp
 
-    global lua_gc
-
 
 ; rcx - boxed c function
 ml_indirect_call:
@@ -62,25 +59,6 @@ ml_get_rsp:
     mov rax, rsp
     ret
 
-lua_gc:
-    push rbx ; alignment
-    push rbx
-    push rbp
-    push r12
-    push r13
-    push r14
-    push r15
-    call lua_gc_impl
-    pop r15
-    pop r14
-    pop r13
-    pop r12
-    pop rbp
-    pop rbx
-    pop rbx ; alignment
-    ret
-
-
 ; inlined
 
 ml_fix_arity_begin:
@@ -0,0 +1,181 @@
+#include "gphm.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MASK(d) ((d)->cap - 1)
+
+// spread the callback hash, h1 picks the group and h2 goes in the control byte
+#define H1(m) ((u32)((m) >> 32))
+#define H2(m) ((u8)((m) >> 57))
+static u64 gphm_mix(u32 h) {
+	return h * UINT64_C(0x9e3779b97f4a7c15);
+}
+
+// bit i set if group byte i == c
+static u32 group_match(const u8 *g, u8 c) {
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i*)g);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+#else
+	u32 m = 0, i;
+	for (i = 0; i < GPHM_GROUP; i++) if (g[i] == c) m |= 1 << i;
+	return m;
+#endif
+}
+
+// bit i set if group byte i is empty or deleted (high bit set)
+static u32 group_match_free(const u8 *g) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g));
+#else
+	u32 m = 0, i;
+	for (i = 0; i < GPHM_GROUP; i++) if (g[i] & 0x80) m |= 1 << i;
+	return m;
+#endif
+}
+
+static void gphm_set_ctrl(gphm_data *d, u32 i, u8 c) {
+	d->ctrl[i] = c;
+	if (i < GPHM_GROUP) d->ctrl[d->cap + i] = c; // mirror
+}
+
+static gphm_data *gphm_data_new(u32 cap, u32 hash) {
+	if (cap < GPHM_GROUP) cap = GPHM_GROUP;
+
+	size_t ctrl = (offsetof(gphm_data, ctrl) + cap + GPHM_GROUP + 7) & ~(size_t)7;
+	gphm_data *d = ML_MALLOC(ctrl + 2 * cap * sizeof(bv));
+	if (!d) return NULL;
+
+	d->cap = cap;
+	d->hash = hash;
+	d->sz = 0;
+	d->growth = cap - cap/8;
+	d->keys = (bv*)((u8*)d + ctrl);
+	d->values = d->keys + cap;
+	memset(d->ctrl, GPHM_EMPTY, cap + GPHM_GROUP);
+
+	return d;
+}
+
+static i64 gphm_find(gphm_data *d, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, u64 m) {
+	u32 pos = H1(m) & MASK(d), stride = 0;
+	u8 h2 = H2(m);
+	for (;;) {
+		const u8 *g = d->ctrl + pos;
+		u32 match = group_match(g, h2);
+		while (match) {
+			u32 i = (pos + __builtin_ctz(match)) & MASK(d);
+			if (!cfn(d->keys[i], key)) return i;
+			match &= match - 1;
+		}
+		if (group_match(g, GPHM_EMPTY)) return -1;
+		stride += GPHM_GROUP;
+		pos = (pos + stride) & MASK(d);
+	}
+}
+
+// first empty or deleted slot on the probe sequence
+static u32 gphm_find_free(gphm_data *d, u64 m) {
+	u32 pos = H1(m) & MASK(d), stride = 0, match;
+	while (!(match = group_match_free(d->ctrl + pos))) {
+		stride += GPHM_GROUP;
+		pos = (pos + stride) & MASK(d);
+	}
+	return (pos + __builtin_ctz(match)) & MASK(d);
+}
+
+static void gphm_insert_new(gphm_data *d, bv key, bv value, u64 m) {
+	u32 i = gphm_find_free(d, m);
+	if (d->ctrl[i] == GPHM_EMPTY) d->growth--;
+	gphm_set_ctrl(d, i, H2(m));
+	d->keys[i] = key;
+	d->values[i] = value;
+	d->sz++;
+}
+
+static int gphm_rehash(gphm *hm, rhhm_hash_fn hfn) {
+	gphm_data *d = hm->data;
+	u32 cap = d->sz * 2 >= d->cap ? d->cap * 2 : d->cap; // else just drop tombstones
+
+	gphm_data *n = gphm_data_new(cap, d->hash);
+	if (!n) return 1;
+
+	for (u32 i = 0; i < d->cap; i++)
+		if (!(d->ctrl[i] & 0x80))
+			gphm_insert_new(n, d->keys[i], d->values[i], gphm_mix(hfn(d->keys[i], d->hash)));
+
+	ML_FREE(d);
+	hm->data = n;
+	return 0;
+}
+
+// length must be a power of two
+int gphm_init(gphm *hm, u32 length, u32 hash) {
+	hm->data = gphm_data_new(length, hash);
+	return hm->data ? 0 : 1;
+}
+
+void gphm_destroy(gphm *hm) {
+	ML_FREE(hm->data);
+	hm->data = NULL;
+}
+
+void gphm_set(gphm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value) {
+	u64 m = gphm_mix(hfn(key, hm->data->hash));
+	i64 i = gphm_find(hm->data, hfn, cfn, key, m);
+	if (i >= 0) {
+		hm->data->values[i] = value;
+		return;
+	}
+	if (!hm->data->growth && gphm_rehash(hm, hfn)) return;
+	gphm_insert_new(hm->data, key, value, m);
+}
+
+bv gphm_get(gphm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
+	i64 i = gphm_find(hm->data, hfn, cfn, key, gphm_mix(hfn(key, hm->data->hash)));
+	return i >= 0 ? hm->data->values[i] : nil;
+}
+
+void gphm_remove(gphm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
+	gphm_data *d = hm->data;
+	i64 i = gphm_find(d, hfn, cfn, key, gphm_mix(hfn(key, d->hash)));
+	if (i < 0) return;
+	gphm_set_ctrl(d, i, GPHM_DELETED);
+	d->sz--;
+}
+
+void gphm_visit(gphm *hm, void *context, gphm_visit_callback cb) {
+	gphm_data *d = hm->data;
+	for (u32 i = 0; i < d->cap; i++)
+		if (!(d->ctrl[i] & 0x80))
+			cb(context, d->keys + i, d->values + i);
+}
+
+
+// string -> int
+void gphm_insert_str(gphm *hm, const char *s, int len, int val) {
+	bv k;
+	k.u = ((u64)len << 48) | (u64)s;
+	bv v;
+	v.i = val;
+	gphm_set(hm, hm_key_hash, hm_key_cmp, k, v);
+}
+
+int gphm_get_str(gphm *hm, const char *s, int len) {
+	bv k;
+	k.u = ((u64)len << 48) | (u64)s;
+	bv v = gphm_get(hm, hm_key_hash, hm_key_cmp, k);
+	if (bv_is_nil(v)) return -1;
+	return v.i;
+}
+
+void gphm_remove_str(gphm *hm, const char *s, int len) {
+	bv k;
+	k.u = ((u64)len << 48) | (u64)s;
+	gphm_remove(hm, hm_key_hash, hm_key_cmp, k);
+}
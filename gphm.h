@@ -0,0 +1,50 @@
+#ifndef GPHM_H
+#define GPHM_H
+
+#include "common.h"
+#include "value.h"
+#include "rhhm.h"
+
+/*
+ * Group Probing Hashmap
+ *
+ * Alternative to rhhm with the same hash/cmp callbacks. Every slot has a
+ * control byte holding 7 bits of its hash (or GPHM_EMPTY/GPHM_DELETED),
+ * lookups compare a whole group of GPHM_GROUP control bytes at once (SSE2)
+ * and only call cfn on matching slots. Keys and values live in separate
+ * arrays, so probing touches control bytes only.
+ */
+#define GPHM_GROUP 16
+#define GPHM_EMPTY   ((u8)0x80)
+#define GPHM_DELETED ((u8)0xfe)
+
+typedef struct gphm_data {
+	u32 cap;     // power of two, >= GPHM_GROUP
+	u32 hash;
+	u32 sz;      // live slots
+	u32 growth;  // slots left before a rehash
+	bv *keys;
+	bv *values;
+	u8 ctrl[1];  // cap + GPHM_GROUP, the tail mirrors the first group
+} gphm_data;
+
+typedef struct gphm {
+	gphm_data *data;
+} gphm;
+
+int  gphm_init(gphm *hm, u32 length, u32 hash);
+void gphm_destroy(gphm *hm);
+
+void gphm_set(gphm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value);
+bv   gphm_get(gphm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key);
+void gphm_remove(gphm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key);
+
+typedef void(*gphm_visit_callback)(void *context, bv *key, bv *value);
+void gphm_visit(gphm *hm, void *context, gphm_visit_callback cb);
+
+// string -> int, same keys as rhhm_*_str
+void gphm_insert_str(gphm *hm, const char *s, int len, int val);
+int gphm_get_str(gphm *hm, const char *s, int len);
+void gphm_remove_str(gphm *hm, const char *s, int len);
+
+#endif // GPHM_H
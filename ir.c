@@ -14,63 +14,110 @@ int ir_is_mark(u32 op) {
 	return op & IR_MARK;
 }
 
+int ir_b_is_count(u32 op) {
+	return op == IR_OP_CALL || op == IR_OP_TSETLIST;
+}
+
 int ir_current(ir *c) {
 	return vsize(c->ops);
 }
 
+// says which limit a chunk hit and quits
+static void ir_limit(const char *what, int max) {
+	printf("too many %s in chunk, at most %d\n", what, max);
+	abort(); // TODO: fail the load instead
+}
+
 int ir_newvar(ir *c) {
+	if (c->iv >= IR_VAR_MAX) ir_limit("variables", IR_VAR_MAX);
+	if (vpush(c->assignment, 0) || vpush(c->sym_cdepth, 0) || vpush(c->types, 0)) abort();
 	return c->iv++;
 }
 
 int ir_init(ir *c) {
-	if (rhhm_init(&c->ctt_map, IR_CTT_MAX*2, 0)) {
+	if (rhhm_init(&c->ctt_map, IR_CTT_INITIAL_SZ, 0)) {
 		return 1;
 	}
-	vclear(c->ctts);
-	vclear(c->ops);
+	vinit(c->ctts);
+	vinit(c->ops);
+	vinit(c->assignment);
+	vinit(c->sym_cdepth);
+	vinit(c->types);
+	vinit(c->phis);
 	c->iv = 0;
-	c->iphi = IR_OP_MAX;
 	c->phidepth = 0;
+	c->scratch.b = NULL;
+	c->scratch.cur = NULL;
 	return 0;
 }
 
 void ir_destroy(ir *c) {
 	rhhm_destroy(&c->ctt_map);
+	vdestroy(c->ctts);
+	vdestroy(c->ops);
+	vdestroy(c->assignment);
+	vdestroy(c->sym_cdepth);
+	vdestroy(c->types);
+	vdestroy(c->phis);
+	ir_scratch_restore(c, (ir_scratch){ NULL, NULL });
 }
 
-int ir_ctt(ir *c, bv v) {
-	if (vfull(c->ctts)) abort();
+void *ir_alloc(ir *c, size_t sz) {
+	sz = (sz + 15) & ~(size_t)15;
+	ir_block *b = c->scratch.b;
+	if (!b || c->scratch.cur + sz > b->end) {
+		size_t bsz = sz > IR_SCRATCH_SZ ? sz : IR_SCRATCH_SZ;
+		if (!(b = ML_MALLOC(sizeof(ir_block) + bsz))) abort();
+		b->prev = c->scratch.b;
+		b->end = b->data + bsz;
+		c->scratch.b = b;
+		c->scratch.cur = b->data;
+	}
+	void *r = c->scratch.cur;
+	c->scratch.cur += sz;
+	return memset(r, 0, sz);
+}
+
+ir_scratch ir_scratch_save(ir *c) {
+	return c->scratch;
+}
 
+void ir_scratch_restore(ir *c, ir_scratch s) {
+	while (c->scratch.b != s.b) {
+		ir_block *b = c->scratch.b;
+		c->scratch.b = b->prev;
+		ML_FREE(b);
+	}
+	c->scratch.cur = s.cur;
+}
+
+int ir_ctt(ir *c, bv v) {
 	bv idx = hm_get(&c->ctt_map, v);
 	if (idx.u != bv_nil) return idx.i;
 
-	vpush(c->ctts, v); //c->ctts[c->ic++] = v;
+	if (vsize(c->ctts) >= IR_CTT_MAX) ir_limit("constants", IR_CTT_MAX);
+	if (vpush(c->ctts, v)) abort();
 
-	idx.i = -vsize(c->ctts); //-c->ic;
+	idx.i = -vsize(c->ctts);
 	hm_set(&c->ctt_map, v, idx);
 
-	return -vsize(c->ctts); //-c->ic;
+	return -vsize(c->ctts);
 }
 
 int ir_op(ir *c, i16 op, i16 a, i16 b, u16 t) {
-	if (vfull(c->ops)) abort();
 	tac tmp;
 	tmp.op = op;
 	tmp.a = a;
 	tmp.b = b;
 	tmp.target = t;
-	vpush(c->ops, tmp);
-	/*int i = c->io++;
-	c->ops[i].op = op;
-	c->ops[i].a = a;
-	c->ops[i].b = b;
-	c->ops[i].target = t;*/
+	if (vsize(c->ops) >= IR_OP_MAX) ir_limit("ops", IR_OP_MAX);
+	if (vpush(c->ops, tmp)) abort();
 	return t;
 }
 
 int ir_phi_begin(ir *c, int type) {
-	int i = --c->iphi;
-	vget(c->ops, i).op = IR_OP_NOOP; // mark
+	tac mark = { .op = IR_OP_NOOP };
+	if (vpush(c->phis, mark)) abort();
 
 	c->phidepth++;
 
@@ -80,33 +127,32 @@ int ir_phi_begin(ir *c, int type) {
 	return c->phidepth;
 }
 
-int ir_phi_ins(ir *c, int val, int old, u16 *assignment) {
+int ir_phi_ins(ir *c, int val, int old) {
 	if (!c->phidepth) return 1;
 
-	int i = c->iphi;
-	while (vget(c->ops, i).op != IR_OP_NOOP) {
-		if (vget(c->ops, i).a == old || vget(c->ops, i).b == old) {
+	int i = vsize(c->phis) - 1;
+	while (vget(c->phis, i).op != IR_OP_NOOP) {
+		if (vget(c->phis, i).a == old || vget(c->phis, i).b == old) {
 			goto found;
 		}
-		i++;
+		i--;
 	}
 
-	i = --c->iphi;
-	vget(c->ops, i).op = IR_OP_PHI;
-	vget(c->ops, i).b = old;
-	vget(c->ops, i).target = old;
+	tac phi = { .op = IR_OP_PHI, .b = old, .target = old };
+	i = vsize(c->phis);
+	if (vpush(c->phis, phi)) abort();
 
 found:
-	vget(c->ops, i).a = val;
+	vget(c->phis, i).a = val;
 	return 0;
 }
 
-int ir_phi_commit(ir *c, u16 *assignment) {
+int ir_phi_commit(ir *c) {
 	int i, j;
-	i = j = c->iphi;
+	i = j = vsize(c->phis) - 1;
 
-	while (vget(c->ops, c->iphi++).op != IR_OP_NOOP) j++;
-	j--;
+	while (vget(c->phis, i).op != IR_OP_NOOP) i--;
+	c->phis.size = i++; // pop the level, phis of the upper one are put where it was
 
 	int jointype = c->phi_join_type[c->phidepth];
 	int joinpos = c->phi_join_pos[c->phidepth];
@@ -114,12 +160,13 @@ int ir_phi_commit(ir *c, u16 *assignment) {
 	int shift = (j-i)+1;
 
 	c->phidepth--;
-	while (j >= i) {
-		int old = vget(c->ops, j).target;
-		int olda = vget(c->ops, j).a;
-		int oldb = vget(c->ops, j).b;
+	while (i <= j) {
+		int old = vget(c->phis, i).target;
+		int olda = vget(c->phis, i).a;
+		int oldb = vget(c->phis, i).b;
 		int nv = ir_newvar(c);
-		
+		u16 *assignment = vbegin(c->assignment);
+
 		assignment[nv] = assignment[old];
 		assignment[old] = nv;
 		assignment[olda] = nv;
@@ -128,21 +175,23 @@ int ir_phi_commit(ir *c, u16 *assignment) {
 		if (jointype != PHI_COND) { // fix loop var usages
 			for (int k = joinpos; k < until; k++) {
 				if (vget(c->ops, k).op == IR_OP_NOOP) continue;
-				int replace = vget(c->ops, j).target; //a;
+				int replace = vget(c->phis, i).target; //a;
 				if (vget(c->ops, k).a == replace) vget(c->ops, k).a = nv;
-				if (vget(c->ops, k).b == replace && vget(c->ops, k).op != IR_OP_CALL)
+				if (vget(c->ops, k).b == replace && !ir_b_is_count(vget(c->ops, k).op))
 					vget(c->ops, k).b = nv;
 			}
 		}
 
-		vget(c->ops, j).target = nv;
-		vpush(c->ops, vget(c->ops, j));
+		vget(c->phis, i).target = nv;
+		tac phi = vget(c->phis, i);
+		if (vsize(c->ops) >= IR_OP_MAX) ir_limit("ops", IR_OP_MAX);
+		if (vpush(c->ops, phi)) abort();
 
 		if (c->phidepth) { // commit to upper level
-			ir_phi_ins(c, nv, old, assignment);
+			ir_phi_ins(c, nv, old);
 		}
 
-		j--;
+		i++;
 	}
 
 	if (jointype != PHI_COND && shift > 0) {
@@ -150,6 +199,8 @@ int ir_phi_commit(ir *c, u16 *assignment) {
 			if (ir_is_jmp(vget(c->ops, k).op) && vget(c->ops, k).target > joinpos)
 				vget(c->ops, k).target += shift;
 
+		// the block moves down through shift spare slots past the end
+		if (vreserve(c->ops, until + 2*shift)) abort();
 		//printf("shifting block of sz %d down %d positions\n", (until-joinpos) + shift, shift);
 		memmove(vbegin(c->ops) + joinpos + shift, vbegin(c->ops) + joinpos, ((until-joinpos) + shift) * sizeof(tac));
 		memcpy(vbegin(c->ops) + joinpos, vbegin(c->ops) + joinpos + shift + (until-joinpos), shift * sizeof(tac));
@@ -159,8 +210,9 @@ int ir_phi_commit(ir *c, u16 *assignment) {
 }
 
 void ir_phi_elim(ir *c) { // eliminate phi nodes
+	ir_scratch s = ir_scratch_save(c);
 
-	u16 var_live_end[IR_OP_MAX] = {0}; // last use of var
+	u16 *var_live_end = ir_alloc(c, c->iv * sizeof(u16)); // last use of var
 	for (int i = 0; i < vsize(c->ops); i++) {
 		int op = vget(c->ops, i).op;
 		if (op == IR_OP_NOOP) continue;
@@ -172,12 +224,12 @@ void ir_phi_elim(ir *c) { // eliminate phi nodes
 
 		if (!ir_is_jmp(op) && target != IR_NO_TARGET) var_live_end[target] = i;
 		if (op != IR_OP_PHI) {
-			if (a != IR_NO_ARG) var_live_end[a] = i;
-			if (b != IR_NO_ARG && op != IR_OP_CALL) var_live_end[b] = i;
+			if (a >= 0) var_live_end[a] = i;
+			if (b >= 0 && !ir_b_is_count(op)) var_live_end[b] = i;
 		}
 	}
-	u16 var_live_ini[IR_OP_MAX]; // first use of var
-	memset(var_live_ini, 0xff, sizeof var_live_ini);
+	u16 *var_live_ini = ir_alloc(c, c->iv * sizeof(u16)); // first use of var
+	memset(var_live_ini, 0xff, c->iv * sizeof(u16));
 	for (int i = vsize(c->ops); i-- > 0; ) {
 		int op = vget(c->ops, i).op;
 		if (op == IR_OP_NOOP || op == IR_FUNCTION_BEGIN || op == IR_FUNCTION_END) continue;
@@ -223,14 +275,14 @@ void ir_phi_elim(ir *c) { // eliminate phi nodes
 
 				while (ai <= ae) {
 					if (vget(c->ops, ai).a == a) vget(c->ops, ai).a = target;
-					if (vget(c->ops, ai).b == a) vget(c->ops, ai).b = target;
+					if (vget(c->ops, ai).b == a && !ir_b_is_count(vget(c->ops, ai).op)) vget(c->ops, ai).b = target;
 					if (!ir_is_jmp(vget(c->ops, ai).op) && vget(c->ops, ai).target == a)
 						vget(c->ops, ai).target = target;
 					ai++;
 				}
 				while (bi <= be) {
 					if (vget(c->ops, bi).a == b) vget(c->ops, bi).a = target;
-					if (vget(c->ops, bi).b == b) vget(c->ops, bi).b = target;
+					if (vget(c->ops, bi).b == b && !ir_b_is_count(vget(c->ops, bi).op)) vget(c->ops, bi).b = target;
 					if (!ir_is_jmp(vget(c->ops, bi).op) && vget(c->ops, bi).target == b)
 						vget(c->ops, bi).target = target;
 					bi++;
@@ -247,6 +299,8 @@ void ir_phi_elim(ir *c) { // eliminate phi nodes
 			}*/
 		}
 	}
+
+	ir_scratch_restore(c, s);
 }
 
 /*opt*/
@@ -268,11 +322,12 @@ static int fold(ir *c, tac *t) {
 }
 
 void ir_opt(ir *c) {
+	ir_scratch s = ir_scratch_save(c);
 
-	BSET(stored, IR_OP_MAX);
+	u32 *stored = ir_alloc(c, (c->iv / 32 + 1) * sizeof(u32));
 
-	u16 var_live_end[IR_OP_MAX] = {0}; // last use of var
-	for (int i = 0; i < IR_OP_MAX; i++) var_live_end[i] = -1;
+	u16 *var_live_end = ir_alloc(c, c->iv * sizeof(u16)); // last use of var
+	memset(var_live_end, 0xff, c->iv * sizeof(u16));
 	for (int i = 0; i < vsize(c->ops); i++) {
 		int op = vget(c->ops, i).op;
 		if (op == IR_OP_NOOP || ir_is_mark(op)) continue;
@@ -287,10 +342,11 @@ void ir_opt(ir *c) {
 		}
 
 		if (a >= 0 && a != IR_NO_ARG) var_live_end[a] = i;
-		if (b >= 0 && b != IR_NO_ARG && op != IR_OP_CALL) var_live_end[b] = i;
+		if (b >= 0 && b != IR_NO_ARG && !ir_b_is_count(op)) var_live_end[b] = i;
+		if (op == IR_OP_TSTORE) var_live_end[vget(c->ops, i).target] = i;
 	}
-	u16 var_live_ini[IR_OP_MAX]; // first use of var
-	memset(var_live_ini, 0xff, sizeof var_live_ini);
+	u16 *var_live_ini = ir_alloc(c, c->iv * sizeof(u16)); // first use of var
+	memset(var_live_ini, 0xff, c->iv * sizeof(u16));
 	for (int i = vsize(c->ops); i-- > 0; ) {
 		int op = vget(c->ops, i).op;
 		if (op == IR_OP_NOOP || ir_is_mark(op)) continue;
@@ -323,12 +379,15 @@ void ir_opt(ir *c) {
 		}
 
 
-		if (o1 == IR_OP_LCOPY && t0 == a1 && var_live_end[a1] == i) {
+		if (o1 == IR_OP_LCOPY && t0 == a1 && var_live_end[a1] == i &&
+			o0 != IR_OP_TSTORE) { // tstore target is a use
 			vget(c->ops, i-1).target = t1;
 			vget(c->ops, i).op = IR_OP_NOOP;
 		}
 
 	}
+
+	ir_scratch_restore(c, s);
 }
 
 #define COLORF(c) "\x1b[3" #c "m"
@@ -372,8 +431,8 @@ void ir_disp(ir *c) {
 		}
 
 		printf(COLORF(4));
-		if (!ir_is_jmp(cur.op)) {
-			switch (c->types[cur.target]) {
+		if (!ir_is_jmp(cur.op) && cur.target < c->iv) {
+			switch (vget(c->types, cur.target)) {
 			/*case IR_TYPE_NONE: printf("%3s ", "<?>"); break;
 			case IR_TYPE_ANY: printf("%3s ", "any"); break;
 			case IR_TYPE_NUM: printf("%3s ", "num"); break;
@@ -395,6 +454,7 @@ void ir_disp(ir *c) {
 			case IR_OP_COPY:   printf("cpy  "); break;
 			case IR_OP_TLOAD:  printf("tget "); break;
 			case IR_OP_TSTORE: printf("tset "); break;
+			case IR_OP_TSETLIST: printf("tlst "); break;
 			case IR_OP_GLOAD:  printf(COLORF(5) "gget " RESETF); break;
 			case IR_OP_GSTORE: printf(COLORF(5) "gset " RESETF); break;
 			case IR_OP_JZ:     printf("jz   "); break;
@@ -415,6 +475,8 @@ void ir_disp(ir *c) {
 			if (cur.a < 0) {
 				if (bv_is_str(vget(c->ctts, -cur.a-1))) {
 					printf("%10s", "str");
+				} else if (bv_type(vget(c->ctts, -cur.a-1)) == bv_ptr) {
+					printf("%10s", "gcell");
 				} else if (bv_is_sstr(vget(c->ctts, -cur.a-1))) {
 					printf(COLORFB(2));
 					printf("%10.*s",
@@ -433,6 +495,8 @@ void ir_disp(ir *c) {
 			if (cur.b < 0) {
 				if (bv_is_str(vget(c->ctts, -cur.b-1))) {
 					printf("%10s", "str");
+				} else if (bv_type(vget(c->ctts, -cur.b-1)) == bv_ptr) {
+					printf("%10s", "gcell");
 				} else if (bv_is_sstr(vget(c->ctts, -cur.b-1))) {
 					printf(COLORFB(2));
 					printf("%10.*s",
@@ -18,6 +18,7 @@ enum {
 
 	IR_OP_TLOAD, // table load
 	IR_OP_TSTORE, // table store
+	IR_OP_TSETLIST, // store the b args after the first index arg to table a
 
 	IR_OP_GLOAD, // global table load
 	IR_OP_GSTORE, // global table store
@@ -67,9 +68,15 @@ enum {
 #define IR_NO_ARG (-32768)
 #define IR_NO_TARGET 0xffff 
 #define IR_DEPTH_MAX 128
-#define IR_CTT_MAX (1<<12)
-#define IR_OP_MAX  (1<<16)
-#define IR_PHI_MAX  (1<<12)
+// limits of the 16 bit tac fields: a and b are i16, constants -1..-32767
+// and vars 0..32767, op indices keep to the same range. Past one the chunk
+// does not compile (ir_limit)
+#define IR_CTT_MAX INT16_MAX
+#define IR_VAR_MAX INT16_MAX
+#define IR_OP_MAX  INT16_MAX
+
+#define IR_CTT_INITIAL_SZ 64
+#define IR_SCRATCH_SZ (1<<14)
 
 enum {
 	PHI_COND = 0,
@@ -78,29 +85,51 @@ enum {
 	PHI_REPEAT
 };
 
-vdef(vector_ctt, bv,  IR_CTT_MAX);
-vdef(vector_op,  tac, IR_OP_MAX);
+vdef(vector_ctt, bv);
+vdef(vector_op,  tac);
+vdef(vector_u16, u16);
+vdef(vector_u8,  u8);
+
+/*
+ * Scratch memory of the passes and the backend, sized by the ir at hand.
+ * Bumped from blocks, released to a save point or all at once by ir_destroy.
+ */
+typedef struct ir_block {
+	struct ir_block *prev;
+	u8 *end;
+	u8 data[];
+} ir_block;
+
+typedef struct {
+	ir_block *b;
+	u8 *cur;
+} ir_scratch;
 
 typedef struct ir {
 	rhhm ctt_map;
 
-	vector_ctt ctts; //bv ctts[IR_CTT_MAX];
-	vector_op   ops; //tac ops[IR_OP_MAX];
+	vector_ctt ctts;
+	vector_op   ops;
 
+	// per var, grown by ir_newvar
 	int iv;
+	vector_u16 assignment; // current assignment, while parsing
+	vector_u8  sym_cdepth; // phi depth of the definition
+	vector_u8  types;
 
 	// phi
+	vector_op phis; // pending phis, a NOOP opens each level
 	int phi_join_pos[IR_DEPTH_MAX];
 	int phi_join_type[IR_DEPTH_MAX];
-	int iphi;
 	int phidepth;
 
-	u8 types[IR_OP_MAX];
+	ir_scratch scratch;
 } ir;
 
 
 int ir_is_jmp(u32 op);
 int ir_is_mark(u32 op);
+int ir_b_is_count(u32 op); // b counts the preceding args, it is no var
 int ir_current(ir *c);
 
 int ir_newvar(ir *c);
@@ -110,10 +139,14 @@ int ir_ctt(ir *c, bv v);
 
 int ir_op(ir *c, i16 op, i16 a, i16 b, u16 t);
 
+void *ir_alloc(ir *c, size_t sz); // zeroed scratch
+ir_scratch ir_scratch_save(ir *c);
+void ir_scratch_restore(ir *c, ir_scratch s);
+
 int ir_phi_begin(ir *c, int type);
-int ir_phi_ins(ir *c, int val, int old, u16 *assignment);
+int ir_phi_ins(ir *c, int val, int old);
 //int ir_phi_restore(ir *c); // restore and swap
-int ir_phi_commit(ir *c, u16 *assignment);
+int ir_phi_commit(ir *c);
 
 void ir_phi_elim(ir *c);
 
@@ -8,83 +8,753 @@
 #include "value.h"
 #include "parser.h"
 #include "rhhm.h"
+#include "shape.h"
 #include "string.h"
 
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 /* gc */
-#define gmalloc malloc
-#define gfree free
+#define gmalloc(gc, sz) (gc)->alloc((gc)->ud, NULL, 0, sz)
+#define grealloc(gc, p, osz, sz) (gc)->alloc((gc)->ud, p, osz, sz)
+#define gfree(gc, p, sz) (gc)->alloc((gc)->ud, p, sz, 0)
 
 struct gc_object {
 	u64 ptr; // lsb == 1 -> broken heart
 };
 
-#define GC_INITIAL_SZ 1024
-int gc_init(struct gc *gc) {
-	gc->cap = GC_INITIAL_SZ;
+#define GC_INITIAL_SZ 1024 // old generation, in tables
+#define GC_HEAP_MIN (1 << 20) // bytes, no cycle starts below
+#define GC_ROUND(sz) (((sz) + 7) & ~(size_t)7) // payload sizes, as accounted
+#define GC_NURSERY_SZ 1024
+#define GC_ARENA_SZ (GC_NURSERY_SZ * 256) // young payloads, in bytes
+#define GC_ARENA_MAX 8192 // larger payloads are malloc'd
+#define GC_SLAB_SZ (1 << 15) // bytes, pages of a size class
+#define GC_REMSET_INITIAL_SZ 64
+
+#define GC_PAUSE_DEFAULT 200   // percent
+#define GC_STEPMUL_DEFAULT 200 // percent
+#define GC_SLICE_US_DEFAULT 1000
+#define GC_STEP_MIN 1024 // work units per slice, at least
+#define GC_STEP_CHECK 256 // work units between clock reads
+#define GC_SWEEP_LIVE 8
+#define GC_STR_DEBT 1024 // strings interned between collections
+#define GC_PAR_MIN 16384 // old tables, below that marking stays serial
+#define GC_PAR_MAX 64
+#define GC_STEAL 64 // gray tables taken at once
+#define GC_FREE_BATCH 1024 // payloads handed to the reclaimer at once
+
+static u64 gc_ntime() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * (u64)1e9 + t.tv_nsec;
+}
 
-	gc->from = gmalloc(gc->cap * 2 * sizeof(rhhm));
-	if (!gc->from) return 1;
-	gc->cur = gc->from;
+/* payloads: young tables bump theirs from the arena */
+static int gc_is_young_payload(struct gc *gc, void *p) {
+	return (u8*)p >= gc->parena && (u8*)p < gc->pcur;
+}
 
-	gc->to = gc->from + gc->cap;
-	gc->writer = gc->reader = gc->to;
+// old tables, malloc'd payloads and long strings
+static u64 gc_heap(struct gc *gc) {
+	return gc->nold * sizeof(table) + gc->bytes;
+}
 
-	return 0;
+// past the limit, the next table allocation collects (see gc_limit).
+// Promotions may get there, payloads of the mutator are refused before
+static void gc_grow(struct gc *gc, size_t sz) {
+	gc->bytes += sz;
+	if (gc->limit && gc_heap(gc) > gc->limit) gc->end = gc->cur;
 }
 
-int gc_grow(state *L) {
-	struct gc *gc = &L->gc;
+/*
+ * Slabs: hash parts of up to 64 slots are most of the payloads that leave the
+ * nursery, they are carved from pages of their size class and kept in a free
+ * list once dead, instead of going through the allocator. The class follows
+ * from the size, so anything of that exact size is in it. Pages start with
+ * the next one and their class, those left empty by a sweep are given back
+ * (see gc_slab_release).
+ */
+#define GC_SLAB_PAGE_CLASS(page) (((u32*)(page))[2])
+
+static int gc_slab_class(size_t sz) {
+	if (sz < RHHM_DATA_SZ(1) || sz > RHHM_DATA_SZ(1 << (GC_SLAB_CLASSES-1))) return -1;
+	size_t n = (sz - RHHM_DATA_SZ(1)) / sizeof(rhhm_value) + 1;
+	if (RHHM_DATA_SZ(n) != sz || (n & (n-1))) return -1;
+	return __builtin_ctzll(n);
+}
+
+static void *gc_slab_alloc(struct gc *gc, int c, size_t sz) {
+	struct gc_slab *s = gc->slab + c;
+	void *p = s->free;
+	if (p) {
+		s->free = *(void**)p;
+		return p;
+	}
+	sz = GC_ROUND(sz);
+	if (s->cur + sz > s->end) {
+		u8 *page = gmalloc(gc, GC_SLAB_SZ);
+		if (!page) return NULL;
+		*(u8**)page = gc->slabs;
+		GC_SLAB_PAGE_CLASS(page) = c;
+		gc->slabs = page;
+		s->cur = page + 16;
+		s->end = page + GC_SLAB_SZ;
+	}
+	p = s->cur;
+	s->cur += sz;
+	return p;
+}
+
+// payloads not in the arena, sz as given by the owner
+static void *gc_heap_alloc(struct gc *gc, size_t sz) {
+	int c = gc_slab_class(sz);
+	void *p = c < 0 ? gmalloc(gc, GC_ROUND(sz)) : gc_slab_alloc(gc, c, sz);
+	if (p) gc_grow(gc, GC_ROUND(sz));
+	return p;
+}
+
+static int gc_slab_page_cmp(const void *a, const void *b) {
+	u8 *x = *(u8**)a, *y = *(u8**)b;
+	return x < y ? -1 : x > y;
+}
+
+// the last of the sorted pages starting at or before p
+static u32 gc_slab_page(u8 **pages, u32 n, void *p) {
+	u32 lo = 0, hi = n;
+	while (hi - lo > 1) {
+		u32 mid = (lo + hi) / 2;
+		if (pages[mid] <= (u8*)p) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// pages whose slots are all free go back to the allocator, but the ones
+// still bumped. Once per cycle, in time with the free slots
+static void gc_slab_release(struct gc *gc) {
+	u32 n = 0, any = 0;
+	for (u8 *p = gc->slabs; p; p = *(u8**)p) n++;
+	if (!n) return;
+	u8 **pages = gmalloc(gc, n * (sizeof(u8*) + sizeof(u32)));
+	if (!pages) return; // tried again next cycle
+	u32 *nfree = (u32*)(pages + n);
+	n = 0;
+	for (u8 *p = gc->slabs; p; p = *(u8**)p) pages[n++] = p;
+	qsort(pages, n, sizeof(u8*), gc_slab_page_cmp);
+	memset(nfree, 0, n * sizeof(u32));
+
+	for (int c = 0; c < GC_SLAB_CLASSES; c++)
+		for (void *p = gc->slab[c].free; p; p = *(void**)p) nfree[gc_slab_page(pages, n, p)]++;
+	for (u32 i = 0; i < n; i++) { // nfree turns into: give it back
+		u32 c = GC_SLAB_PAGE_CLASS(pages[i]);
+		u32 slots = (GC_SLAB_SZ - 16) / GC_ROUND(RHHM_DATA_SZ(1 << c));
+		nfree[i] = nfree[i] == slots && gc->slab[c].end != pages[i] + GC_SLAB_SZ;
+		any |= nfree[i];
+	}
 
-	u64 diff = gc->cur - gc->from;
+	if (any) {
+		for (int c = 0; c < GC_SLAB_CLASSES; c++)
+			for (void **link = &gc->slab[c].free; *link;)
+				if (nfree[gc_slab_page(pages, n, *link)]) *link = *(void**)*link;
+				else link = *link;
+		for (u8 **link = &gc->slabs; *link;) {
+			u8 *p = *link;
+			if (!nfree[gc_slab_page(pages, n, p)]) {
+				link = (u8**)p;
+				continue;
+			}
+			*link = *(u8**)p;
+			gfree(gc, p, GC_SLAB_SZ);
+		}
+	}
+	gfree(gc, pages, n * (sizeof(u8*) + sizeof(u32)));
+}
 
-	rhhm *old = gc->to;
-	if (gc->from < gc->to) old = gc->from;
+static void gc_heap_free(struct gc *gc, void *p, size_t sz) {
+	int c = gc_slab_class(sz);
+	gc->bytes -= GC_ROUND(sz);
+	gc->stats.freed += GC_ROUND(sz);
+	if (c < 0) {
+		gfree(gc, p, GC_ROUND(sz));
+		return;
+	}
+	*(void**)p = gc->slab[c].free;
+	gc->slab[c].free = p;
+}
 
-	gc->to = gmalloc(gc->cap * 4 * sizeof(rhhm));
-	if (!gc->to) return 1;
-	gc->writer = gc->reader = gc->to;
+// sz more bytes would be past the limit, nothing can collect from inside
+// the allocator, the caller raises an error instead
+static int gc_over(struct gc *gc, i64 sz) {
+	return gc->limit && gc_heap(gc) + sz > gc->limit;
+}
 
-	lua_gc(L);
+static void *gc_payload_alloc(void *ctx, void *owner, size_t sz) {
+	struct gc *gc = ctx;
+	if ((u8*)owner < (u8*)gc->nursery || (u8*)owner >= (u8*)gc->cur)
+		return gc_over(gc, GC_ROUND(sz)) ? NULL : gc_heap_alloc(gc, sz);
+
+	size_t r = GC_ROUND(sz);
+	if (r <= GC_ARENA_MAX) {
+		if (gc->pcur + r <= gc->pend) {
+			void *p = gc->pcur;
+			gc->pcur += r;
+			return p;
+		}
+		gc->end = gc->cur; // arena is full, collect at the next table
+	}
+	if (gc_over(gc, r)) return NULL;
+	gc->nmalloc++;
+	return gc_heap_alloc(gc, sz);
+}
 
-	gc->cap *= 2;
-	gc->from = gc->to + gc->cap;
-	gc->cur = gc->from + diff;
+static void gc_payload_free(void *ctx, void *p, size_t sz) {
+	struct gc *gc = ctx;
+	if (!p || gc_is_young_payload(gc, p)) return;
+	gc_heap_free(gc, p, sz);
+}
 
-	gfree(old);
+static void *gc_payload_realloc(void *ctx, void *owner, void *p, size_t old, size_t sz) {
+	struct gc *gc = ctx;
+	if (!gc_is_young_payload(gc, p) && gc_slab_class(old) < 0 && gc_slab_class(sz) < 0 &&
+		((u8*)owner < (u8*)gc->nursery || (u8*)owner >= (u8*)gc->cur)) {
+		if (gc_over(gc, (i64)GC_ROUND(sz) - (i64)GC_ROUND(old))) return NULL;
+		void *n = grealloc(gc, p, GC_ROUND(old), GC_ROUND(sz));
+		if (n) gc_grow(gc, GC_ROUND(sz) - GC_ROUND(old));
+		return n;
+	}
+
+	void *n = gc_payload_alloc(gc, owner, sz);
+	if (!n || !p) return n;
+	memcpy(n, p, old < sz ? old : sz);
+	gc_payload_free(gc, p, old);
+	return n;
+}
+
+// p leaves the arena, copies are made in promotion order (breadth first).
+// Out of memory, p stays and the arena is kept until a later minor
+// collection promotes it (see gc_minor)
+static void *gc_payload_promote(struct gc *gc, void *p, size_t sz) {
+	if (!gc_is_young_payload(gc, p)) return p;
+	void *n = gc_heap_alloc(gc, sz);
+	if (!n) {
+		gc->pinned = 1;
+		return p;
+	}
+	gc->stats.copied += GC_ROUND(sz);
+	return memcpy(n, p, sz);
+}
+
+static void gc_promote_table(struct gc *gc, table *t) {
+	rhhm_data *d = t->hash.data;
+	if (d && !RHHM_IS_LAZY(d)) {
+		if (d->old) d->old = gc_payload_promote(gc, d->old, RHHM_DATA_SZ(d->old->cap));
+		t->hash.data = gc_payload_promote(gc, d, RHHM_DATA_SZ(d->cap));
+	}
+	t->array.data = gc_payload_promote(gc, t->array.data, t->array.cap * sizeof(bv));
+	if (t->slots) t->slots = gc_payload_promote(gc, t->slots, shape_cap(t->shape->nslots) * sizeof(bv));
+}
+
+/*
+ * Background freeing: payloads of dead tables are batched and freed by a
+ * reclaimer thread, started with the first batch. Without it, when a batch
+ * can not be allocated, or with an allocator other than the default one
+ * (which may not be thread safe), they are freed right away.
+ */
+typedef struct gc_batch {
+	struct gc_batch *next;
+	u32 n;
+	void *p[GC_FREE_BATCH];
+} gc_batch;
+
+struct gc_reclaim {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	gc_batch *pending;
+	int stop;
+};
+
+static void *gc_reclaim_run(void *context) {
+	struct gc_reclaim *r = context;
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (!r->pending && !r->stop) pthread_cond_wait(&r->cond, &r->lock);
+		gc_batch *b = r->pending;
+		r->pending = NULL;
+		if (!b && r->stop) break;
+		pthread_mutex_unlock(&r->lock);
+		while (b) {
+			gc_batch *next = b->next;
+			for (u32 i = 0; i < b->n; i++) ML_FREE(b->p[i]);
+			ML_FREE(b);
+			b = next;
+		}
+		pthread_mutex_lock(&r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+
+static void gc_reclaim_flush(struct gc *gc) {
+	gc_batch *b = gc->batch;
+	if (!b || !b->n) return;
+	if (!gc->reclaim) {
+		struct gc_reclaim *r = ML_MALLOC(sizeof *r);
+		if (r) {
+			pthread_mutex_init(&r->lock, NULL);
+			pthread_cond_init(&r->cond, NULL);
+			r->pending = NULL;
+			r->stop = 0;
+			if (pthread_create(&r->thread, NULL, gc_reclaim_run, r)) {
+				pthread_mutex_destroy(&r->lock);
+				pthread_cond_destroy(&r->cond);
+				ML_FREE(r);
+				r = NULL;
+			}
+		}
+		if (!r) { // free them here
+			for (u32 i = 0; i < b->n; i++) ML_FREE(b->p[i]);
+			b->n = 0;
+			return;
+		}
+		gc->reclaim = r;
+	}
+	pthread_mutex_lock(&gc->reclaim->lock);
+	b->next = gc->reclaim->pending;
+	gc->reclaim->pending = b;
+	pthread_cond_signal(&gc->reclaim->cond);
+	pthread_mutex_unlock(&gc->reclaim->lock);
+	gc->batch = NULL;
+}
+
+static void gc_reclaim_stop(struct gc *gc) {
+	gc_reclaim_flush(gc);
+	ML_FREE(gc->batch);
+	gc->batch = NULL;
+	struct gc_reclaim *r = gc->reclaim;
+	if (!r) return;
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	ML_FREE(r);
+	gc->reclaim = NULL;
+}
+
+static void gc_defer_free(struct gc *gc, void *p, size_t sz) {
+	if (!p || gc_is_young_payload(gc, p)) return;
+	if (gc->alloc != ml_default_alloc || gc_slab_class(sz) >= 0) {
+		gc_heap_free(gc, p, sz);
+		return;
+	}
+	gc->bytes -= GC_ROUND(sz);
+	gc->stats.freed += GC_ROUND(sz);
+	if (!gc->batch) {
+		gc->batch = ML_MALLOC(sizeof(gc_batch));
+		if (!gc->batch) {
+			ML_FREE(p);
+			return;
+		}
+		gc->batch->n = 0;
+	}
+	gc->batch->p[gc->batch->n++] = p;
+	if (gc->batch->n == GC_FREE_BATCH) gc_reclaim_flush(gc);
+}
+
+// table payloads and shapes of this thread come from gc (see ml_payload)
+static void gc_enter(struct gc *gc) {
+	if (ml_payload.ctx != gc)
+		ml_payload = (ml_allocator){ gc_payload_alloc, gc_payload_realloc, gc_payload_free, gc };
+}
+
+int gc_init(struct gc *gc, ml_alloc f, void *ud) {
+	memset(gc, 0, sizeof *gc);
+	gc->alloc = f;
+	gc->ud = ud;
+
+	gc->nursery = gmalloc(gc, GC_NURSERY_SZ * sizeof(table));
+	gc->queue = gmalloc(gc, GC_NURSERY_SZ * sizeof(table*));
+	gc->parena = gmalloc(gc, GC_ARENA_SZ);
+	if (!gc->nursery || !gc->queue || !gc->parena) return 1;
+	gc->cur = gc->nursery;
+	gc->end = gc->nursery + GC_NURSERY_SZ;
+	gc->pcur = gc->parena;
+	gc->pend = gc->parena + GC_ARENA_SZ;
+	gc_enter(gc);
+
+	gc->white = GC_WHITE0;
+	gc->threshold = GC_HEAP_MIN;
+	gc->pause = GC_PAUSE_DEFAULT;
+	gc->stepmul = GC_STEPMUL_DEFAULT;
+	gc->slice_us = GC_SLICE_US_DEFAULT;
+	gc->threads = 1;
 
 	return 0;
 }
 
+static void gc_free_table(struct gc *gc, table *t);
+
+void gc_release(struct gc *gc) {
+	for (table *t = gc->nursery; t < gc->cur; t++) gc_free_table(gc, t);
+	for (gc_block *b = gc->blocks; b; b = b->next)
+		for (table *t = b->t; t < b->t + b->used; t++)
+			if (!(t->gcflags & GC_FREE)) gc_free_table(gc, t);
+}
+
 void gc_destroy(struct gc *gc) {
 	if (!gc) return;
-	if (gc->from < gc->to) gfree(gc->from);
-	else gfree(gc->to);
+	gc_reclaim_stop(gc);
+	while (gc->slabs) {
+		u8 *next = *(u8**)gc->slabs;
+		gfree(gc, gc->slabs, GC_SLAB_SZ);
+		gc->slabs = next;
+	}
+	while (gc->blocks) {
+		gc_block *next = gc->blocks->next;
+		gfree(gc, gc->blocks, sizeof(gc_block) + (gc->blocks->cap-1) * sizeof(table));
+		gc->blocks = next;
+	}
+	gfree(gc, gc->nursery, GC_NURSERY_SZ * sizeof(table));
+	gfree(gc, gc->queue, GC_NURSERY_SZ * sizeof(table*));
+	gfree(gc, gc->parena, GC_ARENA_SZ);
+	gfree(gc, gc->remset, gc->remcap * sizeof(table*));
 }
 
 void *gc_new(struct gc *gc) {
-	if (gc->cur == gc->from + gc->cap) {
+	if (gc->cur == gc->end) {
 		return NULL;
 	}
 	
-	rhhm *t = gc->cur++;
+	table *t = gc->cur++;
 	
 	return t;
 }
 
-rhhm *gc_evacuate(struct gc *gc, rhhm *obj) {
-	if (obj >= gc->from && obj < gc->from + gc->cap) { // move to tospace
-		struct gc_object *gobj = (struct gc_object*)obj;
-		if (gobj->ptr & 1) { // broken heart
-			return (rhhm*)(gobj->ptr & 0xfffffffffffffffe);
+static int gc_in(table *obj, table *begin, table *end) {
+	return obj >= begin && obj < end;
+}
+
+static void gc_free_table(struct gc *gc, table *t) {
+	rhhm_data *d = t->hash.data;
+	if (d && !RHHM_IS_LAZY(d)) {
+		if (d->old) gc_defer_free(gc, d->old, RHHM_DATA_SZ(d->old->cap));
+		gc_defer_free(gc, d, RHHM_DATA_SZ(d->cap));
+	}
+	gc_defer_free(gc, t->array.data, t->array.cap * sizeof(bv));
+	if (t->slots) gc_defer_free(gc, t->slots, shape_cap(t->shape->nslots) * sizeof(bv));
+}
+
+/* old generation: blocks of tables, dead ones are kept in a free list */
+static void gc_old_free(struct gc *gc, table *t) {
+	t->gcflags = GC_FREE;
+	t->hash.data = (rhhm_data*)gc->free;
+	gc->free = t;
+	gc->nfree++;
+}
+
+// room for n more old tables
+static int gc_reserve(struct gc *gc, u64 n) {
+	if (gc->nfree >= n) return 0;
+
+	u64 cap = gc->ncap > GC_INITIAL_SZ ? gc->ncap : GC_INITIAL_SZ;
+	if (cap < n) cap = n;
+	gc_block *b = gmalloc(gc, sizeof(gc_block) + (cap-1) * sizeof(table));
+	if (!b) return 1;
+
+	if (gc->blocks) { // only the newest block is bumped, free what is left
+		gc_block *o = gc->blocks;
+		gc->nfree -= o->cap - o->used;
+		while (o->used < o->cap) gc_old_free(gc, o->t + o->used++);
+	}
+	b->next = gc->blocks;
+	b->cap = cap;
+	b->used = 0;
+	gc->blocks = b;
+	gc->ncap += cap;
+	gc->nfree += cap;
+	return 0;
+}
+
+static table *gc_old_new(struct gc *gc) {
+	table *t = gc->free;
+	if (t) gc->free = (table*)t->hash.data;
+	else t = gc->blocks->t + gc->blocks->used++;
+	gc->nfree--;
+	gc->nold++;
+	return t;
+}
+
+// obj is a live old table
+static int gc_is_old(struct gc *gc, table *obj) {
+	for (gc_block *b = gc->blocks; b; b = b->next) {
+		if (!gc_in(obj, b->t, b->t + b->used)) continue;
+		if (((u8*)obj - (u8*)b->t) % sizeof(table)) return 0;
+		return !(obj->gcflags & GC_FREE);
+	}
+	return 0;
+}
+
+/* incremental marking */
+static void gc_gray(struct gc *gc, table *t) {
+	t->gcflags &= ~(GC_WHITE0 | GC_WHITE1 | GC_BLACK);
+	t->gclist = gc->gray;
+	gc->gray = t;
+}
+
+// black t was written, rescan it in the atomic step only, so tables written
+// in a loop are not traversed again in every slice
+static void gc_gray_again(struct gc *gc, table *t) {
+	t->gcflags &= ~GC_BLACK;
+	t->gclist = gc->grayagain;
+	gc->grayagain = t;
+}
+
+// young tables have no color, so they are never marked. Strings have no
+// children, they turn black right away
+static void gc_mark(struct gc *gc, bv v) {
+	if (bv_is_tbl(v)) {
+		if (((table*)bv_get_ptr(v))->gcflags & gc->white) gc_gray(gc, bv_get_ptr(v));
+	} else if (bv_is_str(v)) {
+		str *s = bv_get_ptr(v);
+		if (s->gcflags & gc->white) s->gcflags ^= gc->white | GC_BLACK;
+	}
+}
+
+static void gc_mark_entry(void *context, rhhm_value *value) {
+	gc_mark((struct gc*)context, value->key);
+	gc_mark((struct gc*)context, value->value);
+}
+
+static void gc_mark_array(struct gc *gc, bv *v, u32 sz) {
+	for (u32 i = 0; i < sz; i++) gc_mark(gc, v[i]);
+}
+
+// blacken one gray table, returns the work done
+static u64 gc_propagate(struct gc *gc) {
+	table *t = gc->gray;
+	gc->gray = t->gclist;
+	t->gcflags |= GC_BLACK;
+
+	rhhm_visit(&t->hash, gc, gc_mark_entry);
+	gc_mark_array(gc, t->array.data, t->array.sz);
+	u32 n = t->shape ? t->shape->nslots : 0;
+	gc_mark_array(gc, t->slots, n);
+	return 1 + t->array.sz + n + rhhm_size(&t->hash);
+}
+
+/*
+ * Parallel marking, when the gray list is drained at once. Each worker owns a
+ * gray list (through table.gclist) and steals from the others when its own
+ * runs out. Colors change atomically: clearing the white bit claims a table.
+ */
+typedef struct gc_worker {
+	struct gc_par *par;
+	pthread_mutex_t lock;
+	table *gray;
+	u32 n;
+	u64 work;
+} gc_worker;
+
+typedef struct gc_par {
+	struct gc *gc;
+	gc_worker w[GC_PAR_MAX];
+	u32 nw;
+	u32 idle;
+} gc_par;
+
+static void gc_par_push(gc_worker *w, table *t) {
+	pthread_mutex_lock(&w->lock);
+	t->gclist = w->gray;
+	w->gray = t;
+	__atomic_store_n(&w->n, w->n + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static table *gc_par_pop(gc_worker *w) {
+	pthread_mutex_lock(&w->lock);
+	table *t = w->gray;
+	if (t) {
+		w->gray = t->gclist;
+		__atomic_store_n(&w->n, w->n - 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return t;
+}
+
+static int gc_par_steal(gc_worker *w) {
+	gc_par *par = w->par;
+	for (u32 i = 1; i < par->nw; i++) {
+		gc_worker *v = par->w + (w - par->w + i) % par->nw;
+		if (!__atomic_load_n(&v->n, __ATOMIC_RELAXED)) continue;
+
+		pthread_mutex_lock(&v->lock);
+		u32 k = (v->n + 1) / 2;
+		if (k > GC_STEAL) k = GC_STEAL;
+		table *t = v->gray, *last = t;
+		for (u32 j = 1; j < k; j++) last = last->gclist;
+		if (k) {
+			v->gray = last->gclist;
+			__atomic_store_n(&v->n, v->n - k, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&v->lock);
+		if (!k) continue;
+
+		pthread_mutex_lock(&w->lock);
+		last->gclist = w->gray;
+		w->gray = t;
+		__atomic_store_n(&w->n, w->n + k, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&w->lock);
+		return 1;
+	}
+	return 0;
+}
+
+static void gc_par_mark(gc_worker *w, bv v) {
+	u32 white = w->par->gc->white;
+	if (bv_is_tbl(v)) {
+		table *t = bv_get_ptr(v);
+		if ((__atomic_load_n(&t->gcflags, __ATOMIC_RELAXED) & white) && (__atomic_fetch_and(&t->gcflags, ~white, __ATOMIC_RELAXED) & white))
+			gc_par_push(w, t);
+	} else if (bv_is_str(v)) {
+		str *s = bv_get_ptr(v);
+		if ((__atomic_load_n(&s->gcflags, __ATOMIC_RELAXED) & white) && (__atomic_fetch_and(&s->gcflags, ~white, __ATOMIC_RELAXED) & white))
+			__atomic_fetch_or(&s->gcflags, GC_BLACK, __ATOMIC_RELAXED);
+	}
+}
+
+static void gc_par_mark_entry(void *context, rhhm_value *value) {
+	gc_par_mark(context, value->key);
+	gc_par_mark(context, value->value);
+}
+
+static void *gc_par_run(void *context) {
+	gc_worker *w = context;
+	gc_par *par = w->par;
+	for (;;) {
+		table *t = gc_par_pop(w);
+		if (t) {
+			__atomic_fetch_or(&t->gcflags, GC_BLACK, __ATOMIC_RELAXED);
+			rhhm_visit(&t->hash, w, gc_par_mark_entry);
+			for (u32 i = 0; i < t->array.sz; i++) gc_par_mark(w, t->array.data[i]);
+			u32 n = t->shape ? t->shape->nslots : 0;
+			for (u32 i = 0; i < n; i++) gc_par_mark(w, t->slots[i]);
+			w->work += 1 + t->array.sz + n + rhhm_size(&t->hash);
+			continue;
+		}
+		if (gc_par_steal(w)) continue;
+
+		// idle workers own no gray tables, when all are idle marking is done
+		__atomic_add_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
+		for (;;) {
+			if (__atomic_load_n(&par->idle, __ATOMIC_SEQ_CST) == par->nw) return NULL;
+			u32 i = 0;
+			while (i < par->nw && !__atomic_load_n(&par->w[i].n, __ATOMIC_RELAXED)) i++;
+			if (i < par->nw) break;
+			sched_yield();
 		}
-		*gc->writer = *obj;
-		gobj->ptr = (((u64)gc->writer) | 1);
-		return gc->writer++;
+		__atomic_sub_fetch(&par->idle, 1, __ATOMIC_SEQ_CST);
 	}
-	return obj;
+}
+
+// blacken all gray tables, returns the work done
+static u64 gc_drain(struct gc *gc) {
+	u64 work = 0;
+	if (gc->threads < 2 || gc->nold < GC_PAR_MIN) {
+		while (gc->gray) work += gc_propagate(gc);
+		return work;
+	}
+
+	gc_par par;
+	pthread_t tid[GC_PAR_MAX];
+	par.gc = gc;
+	par.nw = gc->threads < GC_PAR_MAX ? gc->threads : GC_PAR_MAX;
+	par.idle = 0;
+	for (u32 i = 0; i < par.nw; i++) {
+		gc_worker *w = par.w + i;
+		w->par = &par;
+		pthread_mutex_init(&w->lock, NULL);
+		w->gray = NULL;
+		w->n = 0;
+		w->work = 0;
+	}
+	for (u32 i = 0; gc->gray; i = (i+1) % par.nw) {
+		table *t = gc->gray;
+		gc->gray = t->gclist;
+		t->gclist = par.w[i].gray;
+		par.w[i].gray = t;
+		par.w[i].n++;
+	}
+
+	int started[GC_PAR_MAX] = {0};
+	for (u32 i = 1; i < par.nw; i++) {
+		started[i] = !pthread_create(tid + i, NULL, gc_par_run, par.w + i);
+		if (!started[i]) __atomic_add_fetch(&par.idle, 1, __ATOMIC_SEQ_CST); // others steal its tables
+	}
+	gc_par_run(par.w);
+	for (u32 i = 0; i < par.nw; i++) {
+		if (i && started[i]) pthread_join(tid[i], NULL);
+		pthread_mutex_destroy(&par.w[i].lock);
+		work += par.w[i].work;
+	}
+	return work;
+}
+
+// old table t is about to point to a table: keep black tables from pointing
+// to white ones (back to gray) and remember t for minor collections
+void gc_barrier(struct gc *gc, table *t) {
+	if (t->gcflags & GC_BLACK) {
+		if (gc->phase == GC_MARK) gc_gray_again(gc, t);
+		else t->gcflags = (t->gcflags & ~GC_BLACK) | gc->white; // swept early
+	}
+
+	if (!(t->gcflags & GC_BARRIER)) return;
+	t->gcflags &= ~GC_BARRIER;
+
+	if (gc->nremset == gc->remcap) {
+		u32 n = gc->remcap ? gc->remcap * 2 : GC_REMSET_INITIAL_SZ;
+		table **r = grealloc(gc, gc->remset, gc->remcap * sizeof(table*), n * sizeof(table*));
+		if (!r) { // can't track it, next minor collection scans all old tables
+			gc->overflow = 1;
+			return;
+		}
+		gc->remset = r;
+		gc->remcap = n;
+	}
+	gc->remset[gc->nremset++] = t;
+}
+
+// v is stored where marking does not look again: global cells, strings
+// stored into black tables
+void gc_barrier_root(struct gc *gc, bv v) {
+	if (gc->phase == GC_MARK) gc_mark(gc, v);
+}
+
+/* minor collection: copy nursery survivors to the old generation */
+table *gc_evacuate(struct gc *gc, table *obj) {
+	if (!gc_in(obj, gc->nursery, gc->end)) return obj;
+
+	struct gc_object *gobj = (struct gc_object*)obj;
+	if (gobj->ptr & 1) { // broken heart
+		return (table*)(gobj->ptr & 0xfffffffffffffffe);
+	}
+	table *t = gc_old_new(gc);
+	*t = *obj;
+	gobj->ptr = (((u64)t) | 1);
+	gc_promote_table(gc, t);
+
+	// while marking, promoted tables are black, their old children are
+	// marked when the queue is scanned
+	t->gcflags = GC_BARRIER | (gc->phase == GC_MARK ? GC_BLACK : gc->white);
+	gc->queue[gc->nqueue++] = t;
+	return t;
 }
 
 void gc_scavenge(void *context, rhhm_value *value) {
@@ -92,116 +762,567 @@ void gc_scavenge(void *context, rhhm_value *value) {
 
 	if (bv_is_tbl(value->key))
 		value->key = bv_make_tbl(
-			gc_evacuate(gc, bv_get_tbl(value->key)));
+			gc_evacuate(gc, bv_get_ptr(value->key)));
 
 	if (bv_is_tbl(value->value))
 		value->value = bv_make_tbl(
-			gc_evacuate(gc, bv_get_tbl(value->value)));
+			gc_evacuate(gc, bv_get_ptr(value->value)));
+
+	if (gc->phase == GC_MARK) gc_mark_entry(gc, value);
 }
 
-void gc_collect(struct gc *gc, rhhm *obj) {
-#ifdef DBG
-	printf("collect %p\n", obj);
-#endif
+void gc_scavenge_array(struct gc *gc, bv *v, u32 sz) {
+	for (u32 i = 0; i < sz; i++) {
+		if (bv_is_tbl(v[i])) v[i] = bv_make_tbl(gc_evacuate(gc, bv_get_ptr(v[i])));
+		else if (!bv_is_str(v[i])) continue;
+		if (gc->phase == GC_MARK) gc_mark(gc, v[i]);
+	}
+}
 
-	gc_evacuate(gc, obj);
+static void gc_scavenge_table(struct gc *gc, table *h) {
+	rhhm_visit(&h->hash, gc, gc_scavenge);
+	gc_scavenge_array(gc, h->array.data, h->array.sz);
+	if (h->shape) gc_scavenge_array(gc, h->slots, h->shape->nslots);
+}
 
-	while (gc->reader < gc->writer) {
-		rhhm *h = gc->reader++;
-		rhhm_visit(h, gc, gc_scavenge);
+// live values in compiled frames, from the innermost call out of them
+typedef void (*gc_root_fn)(struct gc *gc, bv *p);
+static void gc_stack(state *L, gc_root_fn fn) {
+	stackmap *m;
+	u64 *sp = L->sp;
+	for (pcall_frame *f = L->frames;; sp = f->sp, f = f->prev) {
+		for (; sp && (m = cc_stackmap((void*)sp[-1])); sp += m->frame + 1)
+			for (u32 i = 0; i < m->n; i++) fn(&L->gc, (bv*)sp + m->slot[i]);
+		if (!f) break;
 	}
 }
 
-void gc_maybe_collect(struct gc *gc, void *root) {
-	if (bv_is_tbl((bv)root))
-		gc_collect(gc, bv_get_ptr((bv)root));
+static void gc_scavenge_root(struct gc *gc, bv *p) {
+	if (bv_is_tbl(*p) && gc_in(bv_get_ptr(*p), gc->nursery, gc->end))
+		*p = bv_make_tbl(gc_evacuate(gc, bv_get_ptr(*p)));
 }
 
-int gc_flip(struct gc *gc) {
+static void gc_mark_root(struct gc *gc, bv *p) {
+	if (!bv_is_tbl(*p) || gc_is_old(gc, bv_get_ptr(*p))) gc_mark(gc, *p);
+}
 
-	while (--gc->cur >= gc->from) {
-		struct gc_object *gobj = (struct gc_object*)gc->cur;
-		if ((gobj->ptr & 1) == 0) { // not forwarded
-			rhhm_destroy(gc->cur);
+static int gc_minor(state *L) {
+	struct gc *gc = &L->gc;
+	if (gc_reserve(gc, gc->cur - gc->nursery)) return 1;
+	gc->nqueue = 0;
+	u64 copied = gc->stats.copied;
+
+	if (gc->pinned) { // the last one ran out of memory, old tables own arena payloads
+		gc->pinned = 0;
+		for (gc_block *b = gc->blocks; b; b = b->next)
+			for (table *t = b->t; t < b->t + b->used; t++)
+				if (!(t->gcflags & GC_FREE)) gc_promote_table(gc, t);
+	}
+
+	L->G = gc_evacuate(gc, L->G);
+	for (gcells *g = L->globals; g; g = g->next)
+		gc_scavenge_array(gc, g->cell, g->n);
+	gc_scavenge_array(gc, L->refs, L->nrefs);
+	gc_stack(L, gc_scavenge_root);
+
+	if (gc->overflow) { // remset is incomplete
+		for (gc_block *b = gc->blocks; b; b = b->next)
+			for (table *t = b->t; t < b->t + b->used; t++)
+				if (!(t->gcflags & GC_FREE)) {
+					gc_scavenge_table(gc, t);
+					t->gcflags |= GC_BARRIER;
+				}
+		gc->overflow = 0;
+	}
+	for (u32 i = 0; i < gc->nremset; i++) {
+		gc_scavenge_table(gc, gc->remset[i]);
+		gc->remset[i]->gcflags |= GC_BARRIER;
+	}
+	gc->nremset = 0;
+
+	for (u32 i = 0; i < gc->nqueue; i++) // grows while scanning
+		gc_scavenge_table(gc, gc->queue[i]);
+
+	if (gc->nmalloc) // dead tables own malloc'd payloads
+		for (table *t = gc->nursery; t < gc->cur; t++)
+			if (!(((struct gc_object*)t)->ptr & 1)) gc_free_table(gc, t);
+	gc->nmalloc = 0;
+
+	gc->stats.minor++;
+	gc->stats.young += gc->cur - gc->nursery;
+	gc->stats.promoted += gc->nqueue;
+	if (!gc->pinned) gc->stats.freed += (gc->pcur - gc->parena) - (gc->stats.copied - copied);
+	gc->stats.copied += gc->nqueue * sizeof(table);
+	gc->cur = gc->nursery;
+	gc->end = gc->nursery + GC_NURSERY_SZ;
+	if (gc->pinned) return 1; // tables are promoted, some payloads are not
+	gc->pcur = gc->parena;
+	return 0;
+}
+
+/* major collection: incremental mark & sweep of the old generation */
+static void gc_start(state *L) {
+	struct gc *gc = &L->gc;
+	gc->phase = GC_MARK;
+	gc_mark(gc, bv_make_tbl(L->G));
+	for (gcells *g = L->globals; g; g = g->next)
+		gc_mark_array(gc, g->cell, g->n);
+	gc_mark_array(gc, L->refs, L->nrefs);
+}
+
+// the nursery is empty, only the stack may hide unmarked references
+static void gc_atomic(state *L) {
+	struct gc *gc = &L->gc;
+	gc->gray = gc->grayagain; // gray is empty here
+	gc->grayagain = NULL;
+	gc_stack(L, gc_mark_root);
+	gc_drain(gc);
+
+	gc->white ^= GC_WHITE0 | GC_WHITE1; // tables still white are dead
+	gc->phase = GC_SWEEP;
+	gc->sweep = gc->blocks;
+	gc->sweep_i = 0;
+	gc->sweep_str = &gc->strings;
+}
+
+// the next cycle starts when the heap grows to pause% of live, or halfway
+// to the limit, so the cycle can finish before reaching it
+static void gc_pace(struct gc *gc) {
+	u64 live = gc_heap(gc);
+	gc->threshold = live * gc->pause / 100;
+	if (gc->threshold < GC_HEAP_MIN) gc->threshold = GC_HEAP_MIN;
+	if (gc->limit) {
+		u64 half = live < gc->limit ? live + (gc->limit - live) / 2 : live;
+		if (gc->threshold > half) gc->threshold = half;
+	}
+}
+
+// a dead table or string costs a unit of work, live ones 1/GC_SWEEP_LIVE
+static u64 gc_sweep(state *L, u64 budget) {
+	struct gc *gc = &L->gc;
+	u64 work = 0;
+	u32 dead = gc->white ^ (GC_WHITE0 | GC_WHITE1);
+	budget *= GC_SWEEP_LIVE;
+	while (gc->sweep && work < budget) {
+		gc_block *b = gc->sweep;
+		for (; gc->sweep_i < b->used && work < budget; gc->sweep_i++, work++) {
+			table *t = b->t + gc->sweep_i;
+			if (t->gcflags & GC_FREE) continue;
+			if (t->gcflags & dead) {
+				gc_free_table(gc, t);
+				gc_old_free(gc, t);
+				gc->nold--;
+				gc->stats.swept++;
+				work += GC_SWEEP_LIVE-1;
+			} else {
+				t->gcflags = (t->gcflags & GC_BARRIER) | gc->white;
+			}
+		}
+		if (gc->sweep_i == b->used) {
+			gc->sweep = b->next;
+			gc->sweep_i = 0;
 		}
-		//gobj->ptr = NULL;
 	}
 
-	u64 diff = gc->writer - gc->to;
+	// dead strings leave the intern pool, fixed ones leave the list
+	while (!gc->sweep && *gc->sweep_str && work < budget) {
+		str *s = *gc->sweep_str;
+		work++;
+		if (s->gcflags & GC_FIXED) {
+			*gc->sweep_str = s->next;
+			gc->nstr--;
+		} else if (s->gcflags & dead) {
+			*gc->sweep_str = s->next;
+			hm_sb_settle(&L->intern_pool); // no stale copy of s left behind
+			hm_sb_remove(&L->intern_pool, bv_make_str(s));
+			gc->bytes -= sizeof(str) + s->sz;
+			str_delete(s, gc->alloc, gc->ud);
+			gc->nstr--;
+			gc->stats.swept++;
+			work += GC_SWEEP_LIVE-1;
+		} else {
+			s->gcflags = gc->white;
+			gc->sweep_str = &s->next;
+		}
+	}
 
-	rhhm *from = gc->from;
-	gc->from = gc->to;
-	gc->to = from;
+	if (!gc->sweep && !*gc->sweep_str) {
+		gc_reclaim_flush(gc);
+		gc_slab_release(gc);
+		gc->phase = GC_PAUSE;
+		gc->stats.major++;
+		gc_pace(gc);
+	}
+	return work / GC_SWEEP_LIVE;
+}
+
+// runs until budget work is done or us microseconds passed (0: no limit)
+static void gc_run(state *L, u64 budget, u64 us) {
+	struct gc *gc = &L->gc;
+	u64 work = 0, t0 = us ? gc_ntime() : 0;
+
+	while (gc->phase != GC_PAUSE && work < budget) {
+		u64 w = 0;
+		if (gc->phase == GC_MARK) {
+			if (budget == (u64)-1) w = gc_drain(gc);
+			while (gc->gray && w < GC_STEP_CHECK) w += gc_propagate(gc);
+			if (!gc->gray) gc_atomic(L);
+		} else {
+			w = gc_sweep(L, GC_STEP_CHECK);
+		}
+		work += w;
+		if (us && gc_ntime() - t0 >= us * 1000) break;
+	}
+}
+
+static int gc_step(state *L, int full) {
+	struct gc *gc = &L->gc;
 
-	gc->cur = gc->from + diff;
-	gc->reader = gc->writer = gc->to;
+	if (gc_minor(L)) return 1;
+	u64 promoted = gc->nqueue + gc->strdebt;
+	gc->strdebt = 0;
 
+	if (full) { // finish the current cycle, then run a whole one
+		gc_run(L, -1, 0);
+		gc_start(L);
+		gc_run(L, -1, 0);
+		return 0;
+	}
+
+	if (gc->phase == GC_PAUSE) {
+		if (gc_heap(gc) <= gc->threshold) return 0;
+		gc_start(L);
+	}
+	u64 budget = (u64)promoted * gc->stepmul / 100;
+	gc_run(L, budget > GC_STEP_MIN ? budget : GC_STEP_MIN, gc->slice_us);
 	return 0;
 }
 
+static int gc_collect(state *L, int full) {
+	struct gc_stats *s = &L->gc.stats;
+	u64 t0 = gc_ntime();
+	int r = gc_step(L, full);
+	u64 ns = gc_ntime() - t0;
+
+	u32 i = 0;
+	for (u64 us = ns / 1000; us && i < GC_HIST-1; us >>= 1) i++;
+	s->pauses[i]++;
+	s->pause_ns += ns;
+	if (ns > s->pause_max_ns) s->pause_max_ns = ns;
+	return r;
+}
+
+// sz more bytes would be past the limit, try a whole cycle before giving up
+static int gc_limit(state *L, size_t sz) {
+	struct gc *gc = &L->gc;
+	if (!gc_over(gc, sz)) return 0;
+	gc_collect(L, 1);
+	return gc_over(gc, sz);
+}
+
+// not enough memory: raises under lua_pcall or lua_loadstring, else the
+// caller gets nil, there is nothing to jump back to
+static bv lua_nomem(state *L) {
+	if (L->frames) lua_error(L);
+	return nil;
+}
+
+void lua_gc_stats(state *L, struct gc_stats *s) {
+	*s = L->gc.stats;
+}
+
+i64 lua_gc(state *L, int what, i64 arg) {
+	struct gc *gc = &L->gc;
+	i64 old;
+	switch (what) {
+	case LUA_GCSTEP: return gc_collect(L, 0);
+	case LUA_GCCOLLECT: return gc_collect(L, 1);
+	case LUA_GCCOUNT: return gc_heap(gc);
+	case LUA_GCPAUSE:
+		old = gc->pause;
+		if (arg >= 0) gc->pause = arg;
+		return old;
+	case LUA_GCSTEPMUL:
+		old = gc->stepmul;
+		if (arg >= 0) gc->stepmul = arg;
+		return old;
+	case LUA_GCSLICE:
+		old = gc->slice_us;
+		if (arg >= 0) gc->slice_us = arg;
+		return old;
+	case LUA_GCLIMIT:
+		old = gc->limit;
+		if (arg >= 0) gc->limit = arg;
+		if (gc->phase == GC_PAUSE) gc_pace(gc);
+		return old;
+	case LUA_GCTHREADS:
+		old = gc->threads;
+		if (arg >= 0) gc->threads = arg ? arg : 1;
+		return old;
+	}
+	return -1;
+}
+
 // table
+// 0-based array index of k, or -1 if k is not a positive integer
+static i64 table_index(bv k) {
+	if (!bv_is_double(k) || k.d < 1 || k.d > UINT32_MAX) return -1;
+	u32 i = (u32)k.d;
+	return i == k.d ? i-1 : -1;
+}
+
+// border moved up to sz, pull following integer keys out of the hash part
+static int table_migrate_array(table *t) {
+	for (;;) {
+		bv k = bv_make_double(t->array.sz + 1);
+		bv v = hm_get(&t->hash, k);
+		if (bv_is_nil(v)) return 0;
+		if (vec_push(&t->array, v)) return 1;
+		hm_remove(&t->hash, k);
+	}
+}
+
+// too many string keys or one not fixed, move slots to the hash part
+static int table_drop_shape(table *t) {
+	for (shape *s = t->shape; s->nslots; s = s->parent) {
+		bv v = t->slots[s->nslots-1];
+		if (!bv_is_nil(v)) hm_set(&t->hash, s->key, v);
+	}
+	ml_payload.free(ml_payload.ctx, t->slots, shape_cap(t->shape->nslots) * sizeof(bv));
+	t->slots = NULL;
+	t->shape = NULL;
+	return 0;
+}
+
+static int table_set_slot(table *t, bv k, bv v) {
+	i32 i = shape_find(t->shape, k);
+	if (i >= 0) {
+		t->slots[i] = v;
+		return 0;
+	}
+	if (bv_is_nil(v)) return 0;
+
+	shape *s = shape_add(t->shape, k);
+	if (!s) return table_drop_shape(t) || table_set(t, k, v); // k is not fixed, or no room
+
+	u32 n = s->nslots;
+	if (!t->slots || n > shape_cap(n-1)) {
+		size_t old = t->slots ? shape_cap(n-1) * sizeof(bv) : 0;
+		bv *slots = ml_payload.realloc(ml_payload.ctx, &t->slots, t->slots, old, shape_cap(n) * sizeof(bv));
+		if (!slots) return 1;
+		t->slots = slots;
+	}
+	t->slots[n-1] = v;
+	t->shape = s;
+	return 0;
+}
+
 int table_set(table *t, bv k, bv v) {
-	hm_set(t, k, v);
+	if (t->shape && shape_is_key(k)) return table_set_slot(t, k, v);
+
+	i64 i = table_index(k);
+	if (i >= 0 && i < t->array.sz) {
+		t->array.data[i] = v;
+		if (i == t->array.sz-1) vec_trim(&t->array);
+		return 0;
+	}
+	if (i >= 0 && i == t->array.sz && !bv_is_nil(v)) { // append
+		hm_remove(&t->hash, k);
+		if (vec_push(&t->array, v)) return 1;
+		return table_migrate_array(t);
+	}
+
+	if (bv_is_nil(v)) hm_remove(&t->hash, k); // lets the table shrink
+	else return hm_set(&t->hash, k, v);
 	return 0;
 }
 
 bv table_get(table *t, bv k) {
-	return hm_get(t, k);
+	if (t->shape && shape_is_key(k)) {
+		i32 i = shape_find(t->shape, k);
+		return i >= 0 ? t->slots[i] : nil;
+	}
+
+	i64 i = table_index(k);
+	if (i >= 0 && i < t->array.sz) return t->array.data[i];
+	return hm_get(&t->hash, k);
 }
 
 
 /* state */
+#define TABLE_NEW_MAX (1<<26) // table.new size hint limit
 #define INITIAL_OBJECT_POOL_SZ 1024
 #define INTERN_POOL_INITIAL_SZ 256
+#define LUA_REFS_INITIAL_SZ 16
 #define G_INITIAL_SZ 256
 
+static void str_delete_entry(void *context, rhhm_value *v) {
+	struct gc *gc = context;
+	if (!bv_is_nil(v->value)) str_delete(bv_get_ptr(v->key), gc->alloc, gc->ud); // else migrated
+}
+
+// payloads of tables need their shapes, which come from the GC's slabs
 void lua_destroy(state *L) {
-	gc_destroy(&L->gc);
+	struct gc *gc = &L->gc;
+	gc_enter(gc);
+	while (L->globals) {
+		gcells *next = L->globals->next;
+		gfree(gc, L->globals, sizeof(gcells));
+		L->globals = next;
+	}
+	gfree(gc, L->refs, L->refcap * sizeof(bv));
+	rhhm_visit(&L->intern_pool, gc, str_delete_entry);
 	rhhm_destroy(&L->intern_pool);
+	gc_release(gc);
+	shape_destroy(L->shape_root);
+	gc_destroy(gc);
+	ml_payload = ml_malloc_allocator;
+}
+
+bv *lua_globalcell(state *L, bv key) {
+	if (bv_is_nil(key)) return NULL; // interning it failed
+	bv c = table_get(L->G, key);
+	if (!bv_is_nil(c)) return bv_get_ptr(c);
+
+	gc_enter(&L->gc);
+	if (!L->globals || L->globals->n == GCELLS_CHUNK) {
+		gcells *g = gmalloc(&L->gc, sizeof(gcells));
+		if (!g) return NULL;
+		g->next = L->globals;
+		g->n = 0;
+		L->globals = g;
+	}
+	bv *cell = L->globals->cell + L->globals->n;
+	*cell = nil; // removed globals keep their cell, holding nil
+	if (table_set(L->G, key, bv_make_ptr(cell))) return NULL; // the cell is reused
+	L->globals->n++;
+	return cell;
 }
 
 void lua_setglobal(state *L, bv key, bv value) {
-	table_set(L->G, key, value);
+	bv *cell = lua_globalcell(L, key);
+	if (cell) *cell = value;
+	gc_barrier_root(&L->gc, value);
 }
 
 bv lua_getglobal(state *L, bv key) {
-	return table_get(L->G, key);
+	bv c = table_get(L->G, key);
+	return bv_is_nil(c) ? nil : *(bv*)bv_get_ptr(c);
+}
+
+int lua_ref(state *L, bv v) {
+	struct gc *gc = &L->gc;
+	int r = L->reffree;
+	if (r != LUA_NOREF) L->reffree = L->refs[r].d;
+	else {
+		if (L->nrefs == L->refcap) {
+			u32 n = L->refcap ? L->refcap * 2 : LUA_REFS_INITIAL_SZ;
+			bv *refs = grealloc(gc, L->refs, L->refcap * sizeof(bv), n * sizeof(bv));
+			if (!refs) return LUA_NOREF;
+			L->refs = refs;
+			L->refcap = n;
+		}
+		r = L->nrefs++;
+	}
+	L->refs[r] = v;
+	gc_barrier_root(gc, v);
+	return r;
+}
+
+bv lua_getref(state *L, int ref) {
+	return L->refs[ref];
+}
+
+void lua_setref(state *L, int ref, bv v) {
+	L->refs[ref] = v;
+	gc_barrier_root(&L->gc, v);
+}
+
+void lua_unref(state *L, int ref) {
+	if (ref == LUA_NOREF) return;
+	L->refs[ref] = bv_make_double(L->reffree);
+	L->reffree = ref;
+}
+
+// t gets a reference to k or v
+static void table_barrier(state *L, table *t, bv k, bv v) {
+	if (bv_is_tbl(k) || bv_is_tbl(v)) gc_barrier(&L->gc, t);
+	else if (t->gcflags & GC_BLACK) { // strings
+		gc_barrier_root(&L->gc, k);
+		gc_barrier_root(&L->gc, v);
+	}
 }
 
 void lua_setfield(state *L, bv table, bv key, bv value) {
-	table_set(bv_get_ptr(table), key, value);
+	gc_enter(&L->gc);
+	table_barrier(L, bv_get_ptr(table), key, value);
+	if (table_set(bv_get_ptr(table), key, value)) lua_error(L); // not enough memory
 }
 
 bv lua_getfield(state *L, bv table, bv key) { // TODO: remove L
 	return table_get(bv_get_ptr(table), key);
 }
 
-bv lua_intern(state *L, char *s, int len) {
-	//printf(" _ intern _ %.*s : ", len, s);
-
-	bv v;
-	if (len > SSTR_MAX_LENGTH) {
-		if (bv_is_nil(v = hm_sb_get_str(&L->intern_pool, s, len))) {
-			void *str = str_new(s, len);
-			v = bv_make_str(str);
-			hm_sb_set(&L->intern_pool, v, v);
-			//puts("<new>");
-		} else {
+// inline cache misses, key is a constant string
+static void ic_update(table *t, bv key, ic *c) {
+	if (!t->shape) return;
+	i32 i = shape_find(t->shape, key);
+	if (i < 0) return;
+	c->shape = t->shape;
+	c->slot = i;
+}
 
-			//puts("<existing>");
-		}
+void lua_setfield_ic(state *L, bv table, bv key, bv value, ic *c) {
+	table_barrier(L, bv_get_ptr(table), key, value);
+	if (table_set(bv_get_ptr(table), key, value)) lua_error(L);
+	ic_update(bv_get_ptr(table), key, c);
+}
 
-	} else {
+bv lua_getfield_ic(state *L, bv table, bv key, ic *c) {
+	ic_update(bv_get_ptr(table), key, c);
+	return table_get(bv_get_ptr(table), key);
+}
 
-		//puts("<small string>");
+bv lua_intern(state *L, char *s, int len) {
+	if (len <= SSTR_MAX_LENGTH) return bv_make_sstr(s, len);
 
-		v = bv_make_sstr(s, len);
+	struct gc *gc = &L->gc;
+	gc_enter(gc);
+	u32 h = str_hash(s, len, L->strseed);
+	bv v = hm_sb_get_str(&L->intern_pool, s, len, h);
+	if (bv_is_nil(v)) {
+		if (gc->strdebt++ >= GC_STR_DEBT) gc_collect(L, 0);
+		if (gc_limit(L, sizeof(str) + len)) return lua_nomem(L);
+		str *o = str_new(s, len, h, gc->alloc, gc->ud);
+		if (!o) return lua_nomem(L);
+		gc_grow(gc, sizeof(str) + len);
+		o->gcflags = gc->white;
+		o->next = gc->strings;
+		gc->strings = o;
+		gc->nstr++;
+		v = bv_make_str(o);
+		if (hm_sb_set(&L->intern_pool, v, v)) return lua_nomem(L); // o is swept
 	}
+
+	// the pool does not keep strings alive: like tables, C code must not
+	// hold the result across allocations. Dead ones not swept yet are revived
+	str *o = bv_get_ptr(v);
+	if (gc->phase == GC_MARK) gc_mark(gc, v);
+	else if (o->gcflags & (GC_WHITE0 | GC_WHITE1) & ~gc->white)
+		o->gcflags = (o->gcflags & GC_FIXED) | gc->white;
+	return v;
+}
+
+bv lua_intern_fixed(state *L, char *s, int len) {
+	bv v = lua_intern(L, s, len);
+	if (bv_is_nil(v)) return v;
+	if (bv_is_str(v)) ((str*)bv_get_ptr(v))->gcflags |= GC_FIXED;
+	shape_fix(L->shape_root, v); // else tables keyed by it use the hash part
 	return v;
 }
 
 int lua_init_G(state *L) {
-	rhhm *t = gc_new(&L->gc);
+	table *t = gc_new(&L->gc);
 	if (!t) return 1;
 	L->G = t;
 
@@ -209,35 +1330,66 @@ int lua_init_G(state *L) {
 	u32 c = (u64)t^(((u64)t)>>32);
 	L->seed = hash = ((hash << 5) + hash) + c;
 
-	return rhhm_init(t, G_INITIAL_SZ, hash);
+	if (vec_init(&t->array, 0)) return 1;
+	t->shape = NULL; // too many keys for a shape
+	t->slots = NULL;
+	t->gcflags = 0; // young
+	return rhhm_init(&t->hash, G_INITIAL_SZ, hash);
 }
 
-bv lua_newtable(state *L) {
+// smallest hash part holding n keys without a resize
+u32 table_hash_cap(u32 n) {
+	if (!n) return TABLE_HASH_SZ; // allocated lazily anyway
+	u32 c = RHHM_MIN_CAP;
+	while ((u64)n * 100 > (u64)c * RHHM_MAX_LOAD_DEFAULT) c *= 2;
+	return c;
+}
+
+bv lua_createtable(state *L, u32 narr, u32 nhash) {
+	gc_enter(&L->gc);
 	table *t = gc_new(&L->gc);
-	if (!t) {
-		// collect
-		if (lua_gc(L)) { // no free space
-			if (gc_grow(L)) { // no more mem
-				return nil; // TODO: handle it
-			}
-		}
-		t = gc_new(&L->gc);
-		if (!t) { // err
-			return nil; // TODO: handle it
-		}
+	if (!t) { // nursery is full, or past the limit
+		if (gc_collect(L, 0)) return lua_nomem(L); // not enough memory to collect
+		if (gc_limit(L, 0) || !(t = gc_new(&L->gc))) return lua_nomem(L);
 	}
 
 	u32 hash = L->seed;
 	u32 c = (u64)t^(((u64)t)>>32);
 	L->seed = hash = ((hash << 5) + hash) + c;
 
-	if (rhhm_init(t, 16, hash)) return nil;
+	t->shape = L->shape_root;
+	t->slots = NULL;
+	t->gcflags = 0; // young
+	if (rhhm_init(&t->hash, table_hash_cap(nhash), hash)) return nil;
+	if (vec_init(&t->array, narr)) return lua_nomem(L); // the table is empty, still valid
 	return bv_make_tbl(t);
 }
 
+bv lua_newtable(state *L) {
+	return lua_createtable(L, 0, 0);
+}
+
+// t[base+i] = v[i] for i in [0, n), from table constructors
+void lua_setlist(state *L, bv tbl, u32 base, u32 n, bv *v) {
+	gc_enter(&L->gc);
+	table *t = bv_get_ptr(tbl);
+	gc_barrier(&L->gc, t);
+	if (base == t->array.sz+1 && !rhhm_size(&t->hash) &&
+		!vec_maybe_resize(&t->array, base-1+n)) {
+		memcpy(t->array.data + base-1, v, n * sizeof(bv));
+		t->array.sz = base-1+n;
+		vec_trim(&t->array);
+		return;
+	}
+	for (u32 i = 0; i < n; i++)
+		if (table_set(t, bv_make_double(base+i), v[i])) lua_error(L);
+}
+
 typedef bv (*lua_function)(state*, int, bv*);
 int lua_register(state *L, lua_function f, char *name) {
-	lua_setglobal(L, lua_intern(L, name, strlen(name)), box_cfunction(f));
+	bv *cell = lua_globalcell(L, lua_intern(L, name, strlen(name)));
+	if (!cell) return 1;
+	*cell = box_cfunction(f);
 	return 0;
 }
 
@@ -285,25 +1437,90 @@ bv dbg_assert(state *L, int nargs, bv *args) {
 	return nil;
 }
 
+// table.new(narr, nhash), empty table with preallocated parts
+bv table_new(state *L, int nargs, bv *args) {
+	u32 n[2] = { 0, 0 };
+	for (int i = 0; i < nargs && i < 2; i++)
+		if (bv_is_double(args[i]) && args[i].d > 0) // NaN is left out too
+			n[i] = args[i].d < TABLE_NEW_MAX ? args[i].d : TABLE_NEW_MAX;
+	return lua_createtable(L, n[0], n[1]);
+}
+
+// gc("stats"): counters of lua_gc_stats, the pause histogram in the array
+// part. Keys are interned before the table exists, so nothing collects it
+static bv sys_gc_stats(state *L) {
+	static char *names[] = { "minor", "major", "young", "promoted", "copied",
+		"freed", "swept", "heap", "survival", "pause_us", "pause_max_us" };
+	enum { NSTATS = sizeof names / sizeof *names };
+	bv k[NSTATS];
+	for (int i = 0; i < NSTATS; i++) k[i] = lua_intern_fixed(L, names[i], strlen(names[i]));
+
+	bv t = lua_createtable(L, GC_HIST, NSTATS);
+	struct gc_stats s;
+	lua_gc_stats(L, &s);
+	double v[NSTATS] = { s.minor, s.major, s.young, s.promoted, s.copied,
+		s.freed, s.swept, gc_heap(&L->gc), s.young ? (double)s.promoted / s.young : 0,
+		s.pause_ns / 1e3, s.pause_max_ns / 1e3 };
+	for (int i = 0; i < NSTATS; i++) table_set(bv_get_ptr(t), k[i], bv_make_double(v[i]));
+	for (int i = 0; i < GC_HIST; i++) table_set(bv_get_ptr(t), bv_make_double(i+1), bv_make_double(s.pauses[i]));
+	return t;
+}
+
+// gc([what [, arg]]), what as in lua_gc: "step", "collect" (the default),
+// "count" (in KB) or a tunable, set to arg when given: "pause", "stepmul",
+// "slice", "limit" (in KB), "threads". Returns the count or the old value.
+// gc("stats") returns a table, see sys_gc_stats
 bv sys_gc(state *L, int nargs, bv *args) {
-	lua_gc(L);
-	return nil;
+	static char *names[] = { "step", "collect", "count", "pause", "stepmul", "slice", "limit", "threads" };
+	int what = LUA_GCCOLLECT;
+	if (nargs > 0) {
+		if (args[0].u == lua_intern(L, "stats", 5).u) return sys_gc_stats(L);
+		for (what = 0; what <= LUA_GCTHREADS; what++)
+			if (args[0].u == lua_intern(L, names[what], strlen(names[what])).u) break;
+		if (what > LUA_GCTHREADS) lua_error(L);
+	}
+	i64 arg = nargs > 1 && bv_is_double(args[1]) && args[1].d >= 0 ? args[1].d : -1;
+	if (what == LUA_GCLIMIT && arg > 0) arg *= 1024;
+	i64 r = lua_gc(L, what, arg);
+	if (what == LUA_GCCOUNT || what == LUA_GCLIMIT) return bv_make_double(r / 1024.0);
+	return bv_make_double(r);
 }
 
 int lua_init(state *L) {
+	return lua_init_alloc(L, ml_default_alloc, NULL);
+}
+
+int lua_init_alloc(state *L, lua_Alloc f, void *ud) {
 	do {
 		L->seed = 5381;
-
-		if (gc_init(&L->gc)) break;
-		if (!(L->G = gc_new(&L->gc))) break;
+		if (getentropy(&L->strseed, sizeof L->strseed)) L->strseed = gc_ntime() ^ (u64)L;
+		L->sp = NULL;
+		L->frames = NULL;
+		L->shape_root = NULL;
+		L->globals = NULL;
+		L->refs = NULL;
+		L->nrefs = L->refcap = 0;
+		L->reffree = LUA_NOREF;
+		L->intern_pool.data = RHHM_LAZY(0, 0); // lua_destroy skips it
+
+		if (gc_init(&L->gc, f, ud)) break;
+		if (!(L->shape_root = shape_new_root())) break;
 		if (rhhm_init(&L->intern_pool, INTERN_POOL_INITIAL_SZ, 0)) break;
 		if (lua_init_G(L)) break;
 
-		lua_register(L, io_print, "print");
-		lua_register(L, dbg_dbg, "dbg");
-		lua_register(L, dbg_assert, "assert");
-		lua_register(L, dbg_assert, "ass");
-		lua_register(L, sys_gc, "gc");
+		if (lua_register(L, io_print, "print") ||
+			lua_register(L, dbg_dbg, "dbg") ||
+			lua_register(L, dbg_assert, "assert") ||
+			lua_register(L, dbg_assert, "ass") ||
+			lua_register(L, sys_gc, "gc")) break;
+
+		bv lib = lua_newtable(L);
+		if (bv_is_nil(lib)) break;
+		if (table_set(bv_get_ptr(lib), lua_intern(L, "new", 3), box_cfunction(table_new))) break;
+		bv *cell = lua_globalcell(L, lua_intern(L, "table", 5));
+		if (!cell) break;
+		*cell = lib;
+		gc_barrier_root(&L->gc, lib);
 
 		return 0;
 	} while (0);
@@ -311,56 +1528,41 @@ int lua_init(state *L) {
 	return 1;
 }
 
-void gc_fix_ptr(struct gc *gc, bv *p) {
-	if (bv_is_tbl(*p)) {
-		rhhm *obj = bv_get_ptr(*p);
-		if (obj >= gc->from && obj < gc->from + gc->cap) {
-			struct gc_object *gobj = (struct gc_object*)obj;
-			if (gobj->ptr & 1) { // broken heart
-				rhhm *fwd = (rhhm*)(gobj->ptr & 0xfffffffffffffffe);
-				*p = bv_make_tbl(fwd);
-			}
-		}
-	}
-}
-
-int lua_gc_impl(state *L) {
-	u64 *top = ml_get_rsp();
-
-	//puts("*gc*");
-
-	gc_collect(&L->gc, L->G);
-
-	//printf("%p to %p : %d\n", L->top, top, L->top - top);
-
-	u64 *p = top;
-	while (p <= L->top) gc_maybe_collect(&L->gc, *p++);
-	p = top;
-	while (p <= L->top) gc_fix_ptr(&L->gc, p++);
-
-	rhhm *fwd = (rhhm*)(((struct gc_object*)L->G)->ptr & 0xfffffffffffffffe);
-	L->G = fwd;
-
-	return gc_flip(&L->gc);
-}
-
 void lua_error(state *L) {
 	longjmp(L->jmpbuf, 1);
 }
 
 
+// errors while loading, like running out of memory, fail the load
 void *lua_loadstring(state *L, char *s) {
+	gc_enter(&L->gc);
 	ir i;
 	ir_init(&i);
 
 	parser p;
-	parser_init(&p, L, &i, s);
+	void *volatile f = NULL;
+	if (parser_init(&p, L, &i, s)) goto done;
+
+	pcall_frame frame = { L->sp, L->frames }; // no compiled frames while loading
+	jmp_buf jb;
+	memcpy(jb, L->jmpbuf, sizeof jb);
+	L->frames = &frame;
+	L->sp = NULL;
 
 	prof_begin("parse");
-	parse_chunk(&p);
+	if (!setjmp(L->jmpbuf)) {
+		parse_chunk(&p);
+		f = compile(p.c);
+	}
 	prof_end();
-
-	return compile(p.c);
+	L->sp = frame.sp;
+	L->frames = frame.prev;
+	memcpy(L->jmpbuf, jb, sizeof jb);
+
+done:
+	parser_destroy(&p);
+	ir_destroy(&i);
+	return f;
 }
 
 #define PAD_LEFT 2
@@ -372,21 +1574,21 @@ void *lua_loadfile(state *L, char *filename) {
 	fseek(f, 0, SEEK_END);
 	int len = ftell(f);
 	rewind(f);
-	char *b = malloc(PAD_LEFT + len + PAD_RIGHT); // padding for lexical scope
+	char *b = gmalloc(&L->gc, PAD_LEFT + len + PAD_RIGHT); // padding for lexical scope
 	if (!b) {
 		fclose(f);
 		return NULL;
 	}
 	if (fread(b+PAD_LEFT, 1, len, f) != len) {
 		fclose(f);
-		free(b);
+		gfree(&L->gc, b, PAD_LEFT + len + PAD_RIGHT);
 		return NULL;
 	};
 	fclose(f);
 	prof_end();
 	b[PAD_LEFT+len] = '\0';
 	void *result = lua_loadstring(L, b+PAD_LEFT);
-	free(b);
+	gfree(&L->gc, b, PAD_LEFT + len + PAD_RIGHT);
 	return result;
 }
 
@@ -394,15 +1596,27 @@ typedef void (*fn)(state*);
 int lua_pcall(state *L, void *f) {
 	if (!L || !f) return 1;
 
+	gc_enter(&L->gc);
 	L->top = ml_get_rsp();
-	
+	pcall_frame frame = { L->sp, L->frames }; // a C function called from compiled code may pcall
+	jmp_buf jb;
+	memcpy(jb, L->jmpbuf, sizeof jb);
+	L->frames = &frame;
+	L->sp = NULL;
+
 	if (setjmp(L->jmpbuf)) {
 		puts(" * RUNTIME ERROR * ");
+		L->sp = frame.sp;
+		L->frames = frame.prev;
+		memcpy(L->jmpbuf, jb, sizeof jb);
 		return 1;
 	}
 	((fn)f)(L);
+	L->sp = frame.sp;
+	L->frames = frame.prev;
+	memcpy(L->jmpbuf, jb, sizeof jb);
 
-	lua_gc(L); // DEBUG ONLY
+	lua_gc(L, LUA_GCCOLLECT, 0); // DEBUG ONLY
 
 	return 0;
 }
@@ -4,43 +4,206 @@
 #include "common.h"
 #include "value.h"
 #include "rhhm.h"
+#include "shape.h"
+#include "string.h"
+#include "vec.h"
 
 #include <setjmp.h>
 
-typedef rhhm table;
+/*
+ * Lua table: integer keys [1, array.sz] live in the array part, everything
+ * else in the hash part. array.data[array.sz-1] is never nil, so array.sz is
+ * a border and key array.sz+1 is never in the hash part.
+ * While shape is not NULL, string keys live in slots, indexed by the shape.
+ */
+typedef struct table {
+	rhhm hash; // must be first: GC forwarding and table hashing use it
+	vec array;
+	shape *shape;
+	bv *slots;
+	u32 gcflags;
+	struct table *gclist; // gray list
+} table;
+
+// gcflags of tables and long strings, young tables have none
+#define GC_BARRIER 1 // old, not in the remset: stores of tables call gc_barrier
+#define GC_WHITE0  2
+#define GC_WHITE1  4
+#define GC_BLACK   8 // no color: gray or gray again
+#define GC_FREE    16
+#define GC_FIXED   32 // strings used by compiled code or shapes, never collected
+
+#define TABLE_HASH_SZ 16 // initial hash part
+
+// per site inline cache for constant string keys
+typedef struct ic {
+	shape *shape; // SHAPE_NONE when empty
+	u64 slot;
+} ic;
+
+/*
+ * Generational GC. New tables are bumped in the nursery, minor collections
+ * copy survivors to the old generation and only read old tables recorded in
+ * the remembered set (remset). The old generation does not move, it is
+ * marked and swept incrementally, in slices run after minor collections.
+ * Tables stored into black tables turn them gray again (gc_barrier).
+ * Long strings do not move, they are marked with the old generation and
+ * swept from the intern pool, which only holds them weakly.
+ * Payloads of young tables are bumped from an arena next to the nursery:
+ * dead young tables cost nothing, survivors get theirs copied out in the
+ * order they are promoted.
+ */
+#define GC_SLAB_CLASSES 7 // rhhm_data of 1 to 64 slots
+
+typedef struct gc_block {
+	struct gc_block *next;
+	u32 cap;
+	u32 used;
+	table t[1];
+} gc_block;
+
+enum { GC_PAUSE = 0, GC_MARK = 1, GC_SWEEP = 2 };
+
+// always on counters, see lua_gc_stats. Survival is promoted / young
+#define GC_HIST 20 // pause histogram: pauses[i] under 2^i us, from 2^(i-1)
+struct gc_stats {
+	u64 minor;    // minor collections
+	u64 major;    // cycles finished
+	u64 young;    // tables allocated in the nursery, as of the last minor
+	u64 promoted; // tables copied to the old generation
+	u64 copied;   // bytes copied by minor collections, tables and payloads
+	u64 freed;    // payload bytes freed
+	u64 swept;    // old tables and strings freed
+	u64 pause_ns; // in lua_gc collections, total
+	u64 pause_max_ns;
+	u64 pauses[GC_HIST]; // the last bucket is open
+};
 
 struct gc {
-	rhhm *from;
-	rhhm *to;
+	// young generation, bump allocated from cur to end
+	table *nursery;
+	table *cur;
+	table *end;
+	table **queue; // promoted in the current minor collection
+	u32 nqueue;
+
+	// payloads of young tables, bump allocated from pcur to pend
+	u8 *parena;
+	u8 *pcur;
+	u8 *pend;
+	u32 nmalloc; // young payloads that did not fit, if any, dead ones are freed
+	int pinned; // promotion ran out of memory, old tables still own some of them
+
+	// small hash parts of old tables, size classes by capacity (see gc_slab_class)
+	struct gc_slab {
+		void *free; // through their first word
+		u8 *cur;
+		u8 *end;
+	} slab[GC_SLAB_CLASSES];
+	u8 *slabs; // pages, through their first word
+
+	// old generation
+	gc_block *blocks; // the first one is bump allocated
+	table *free;
+	u64 nfree; // free list and unbumped slots
+	u64 ncap;
+	u64 nold;  // live or not swept yet
+
+	// long strings, not fixed
+	str *strings;
+	u64 nstr;
+	u32 strdebt; // interned since the last collection
+
+	// payloads of dead tables, freed by a background thread
+	struct gc_batch *batch;
+	struct gc_reclaim *reclaim;
+
+	// old tables that may point to young ones
+	table **remset;
+	u32 nremset;
+	u32 remcap;
+	int overflow; // remset alloc failed, next minor scans all old tables
 
-	rhhm *cur;
+	// incremental cycle
+	int phase;
+	u32 white;    // GC_WHITE0 or GC_WHITE1, the other one is dead when sweeping
+	table *gray;  // through table.gclist
+	table *grayagain; // written while black
+	gc_block *sweep;
+	u32 sweep_i;
+	str **sweep_str; // after the blocks
+	u64 threshold; // heap size that starts a cycle
 
-	rhhm *writer;
-	rhhm *reader;
+	// heap size in bytes is gc_heap(): old tables and these
+	u64 bytes; // malloc'd payloads and long strings
+	u64 limit; // 0: none
 
-	u64 cap;
+	struct gc_stats stats;
+
+	ml_alloc alloc; // of the state
+	void *ud;
+
+	// tunables
+	u32 pause;    // next cycle starts when the heap grows to pause% of live
+	u32 stepmul;  // work per promoted table, in percent
+	u32 slice_us; // pause time target of a slice
+	u32 threads;  // markers when the gray list is drained at once
 };
 
-int gc_init(struct gc *gc);
+int gc_init(struct gc *gc, ml_alloc f, void *ud);
+void gc_release(struct gc *gc); // payloads of all tables, before their shapes
 void gc_destroy(struct gc *gc);
-int gc_resize(struct gc *gc, u64 sz);
+void gc_barrier(struct gc *gc, table *t);
+void gc_barrier_root(struct gc *gc, bv v);
+
+/*
+ * Global values live in cells that never move, G maps names to boxed cell
+ * pointers. Compiled code resolves globals to their cells once.
+ */
+#define GCELLS_CHUNK 256
+
+typedef struct gcells {
+	struct gcells *next;
+	u32 n;
+	bv cell[GCELLS_CHUNK];
+} gcells;
+
+// compiled frames below a pcall made from C, walked after those above it
+typedef struct pcall_frame {
+	u64 *sp;
+	struct pcall_frame *prev;
+} pcall_frame;
 
 typedef struct state {
 	// pcall vars
 	jmp_buf jmpbuf;
 	u64 *top;
+	u64 *sp; // rsp at the innermost call out of compiled code, see cc_stackmap
+	pcall_frame *frames; // of the enclosing pcalls, innermost first
 
 	// global table
-	rhhm *G;
+	table *G;
+	gcells *globals;
+
+	// registry, free slots hold the next free one as a number
+	bv *refs;
+	u32 nrefs;
+	u32 refcap;
+	int reffree;
 
 	// string interning
 	rhhm intern_pool;
 
+	// empty table shape
+	shape *shape_root;
+
 	// GC
 	struct gc gc;
 
 	// table 'hashing'
 	u32 seed;
+	u64 strseed; // str_hash, random
+
 } state;
 
 bv table_get(table *t, bv k);
@@ -55,21 +218,49 @@ void lua_setglobal(state *L, bv key, bv value);
 
 bv lua_getglobal(state *L, bv key);
 
+bv *lua_globalcell(state *L, bv key);
+
 void lua_setfield(state *L, bv table, bv key, bv value);
 
 bv lua_getfield(state *L, bv table, bv key);
 
-bv lua_intern(state *L, char *s, int len);
+void lua_setfield_ic(state *L, bv table, bv key, bv value, ic *c);
+
+bv lua_getfield_ic(state *L, bv table, bv key, ic *c);
+
+bv lua_intern(state *L, char *s, int len); // nil when out of memory outside a pcall
+bv lua_intern_fixed(state *L, char *s, int len); // never collected
 bv lua_newtable(state *L);
+bv lua_createtable(state *L, u32 narr, u32 nhash);
+u32 table_hash_cap(u32 n);
+void lua_setlist(state *L, bv table, u32 base, u32 n, bv *v);
 typedef bv (*lua_function)(state*, int, bv*);
 int lua_register(state *L, lua_function f, char *name);
 
 bv io_print(state *L, int nargs, bv *args);
 
-int lua_init(state *L);
+/*
+ * Registry: slots where the host keeps values across collections. They are
+ * roots and follow the tables the GC moves, released slots are reused.
+ */
+#define LUA_NOREF (-1)
+int lua_ref(state *L, bv v); // LUA_NOREF when out of memory
+bv lua_getref(state *L, int ref);
+void lua_setref(state *L, int ref, bv v);
+void lua_unref(state *L, int ref);
+
+/*
+ * Memory of a state comes from its allocator, f(ud, p, osize, nsize) as in
+ * lua_Alloc, except for compiled code. Calls taking L allocate from it, those
+ * that do not (table_set) from the state last entered on the calling thread.
+ * The GC frees payloads on a background thread only with the default one.
+ */
+typedef ml_alloc lua_Alloc;
+int lua_init(state *L); // with ml_default_alloc
+int lua_init_alloc(state *L, lua_Alloc f, void *ud);
 
 
-void lua_error(state *L);
+void lua_error(state *L); // to the innermost lua_pcall or lua_loadstring
 
 
 void *lua_loadstring(state *L, char *s);
@@ -77,6 +268,18 @@ void *lua_loadstring(state *L, char *s);
 void *lua_loadfile(state *L, char *filename);
 typedef void (*fn)(state*);
 int lua_pcall(state *L, void *f);
-int lua_gc(state *L);
+// lua_gc options, setters leave a negative arg alone and return the old value
+enum {
+	LUA_GCSTEP,    // minor collection and a slice, 0 or 1 on failure
+	LUA_GCCOLLECT, // finish the cycle and run a whole one
+	LUA_GCCOUNT,   // heap size in bytes
+	LUA_GCPAUSE,   // next cycle starts when the heap grows to pause% of live
+	LUA_GCSTEPMUL, // work per promoted table, in percent
+	LUA_GCSLICE,   // pause time target of a slice, in us
+	LUA_GCLIMIT,   // heap limit in bytes, 0: none. Tables past it raise an error
+	LUA_GCTHREADS, // markers of whole cycles
+};
+i64 lua_gc(state *L, int what, i64 arg);
+void lua_gc_stats(state *L, struct gc_stats *s);
 
 #endif // LAPI_H
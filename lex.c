@@ -1,18 +1,168 @@
 #include "common.h"
 #include "lex.h"
 
-#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
 
-#define VALID(a) (isalnum(a) || a == '_')
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+/* character classes, ASCII only like isalnum in the C locale */
+#define C_ID    1 // letters, digits and '_'
+#define C_DIGIT 2
+#define C_BLANK 4
+#define C_HEX   8
+
+static const u8 lex_class[256] = {
+	['0' ... '9'] = C_ID | C_DIGIT | C_HEX,
+	['a' ... 'z'] = C_ID,
+	['A' ... 'Z'] = C_ID,
+	['a' ... 'f'] = C_ID | C_HEX,
+	['A' ... 'F'] = C_ID | C_HEX,
+	['_'] = C_ID,
+	[' '] = C_BLANK, ['\t'] = C_BLANK, ['\r'] = C_BLANK, ['\n'] = C_BLANK,
+};
+
+#define IS(c, k) (lex_class[(u8)(c)] & (k))
+
+/*
+ * keywords: perfect hash on the first and last char and the length, checked
+ * against the one candidate
+ */
+#define KW_HASH(s, n) (((u8)(s)[0] + (u8)(s)[(n)-1] * 11 + (n) * 4) & 63)
+
+static const struct { char s[8]; int length; int type; } lex_kw[64] = {
+	[0] = { "function", 8, LEX_FUNCTION },
+	[4] = { "return", 6, LEX_RETURN },
+	[6] = { "repeat", 6, LEX_REPEAT },
+	[12] = { "else", 4, LEX_ELSE },
+	[15] = { "break", 5, LEX_BREAK },
+	[17] = { "false", 5, LEX_FALSE },
+	[19] = { "if", 2, LEX_IF },
+	[24] = { "for", 3, LEX_FOR },
+	[27] = { "true", 4, LEX_TRUE },
+	[29] = { "or", 2, LEX_OR },
+	[30] = { "nil", 3, LEX_NIL },
+	[31] = { "elseif", 6, LEX_ELSEIF },
+	[34] = { "while", 5, LEX_WHILE },
+	[36] = { "local", 5, LEX_LOCAL },
+	[43] = { "in", 2, LEX_IN },
+	[45] = { "until", 5, LEX_UNTIL },
+	[49] = { "do", 2, LEX_DO },
+	[54] = { "not", 3, LEX_NOT },
+	[57] = { "and", 3, LEX_AND },
+	[61] = { "end", 3, LEX_END },
+	[62] = { "then", 4, LEX_THEN },
+};
+
+/*
+ * runs: 16 bytes at a time while the load stays in the page, as the source
+ * may end right at the terminator, then byte by byte
+ */
+#define PAGE_SAFE(s, n) ((((uintptr_t)(s)) & 4095) <= 4096 - (n))
+#define OVERREAD __attribute__((no_sanitize_address))
+
+// the candidate is zero padded, compared as one word
+OVERREAD static int lex_keyword(const char *s, int n) {
+	if (n < 2 || n > 8) return LEX_ID;
+	int h = KW_HASH(s, n);
+	if (lex_kw[h].length != n) return LEX_ID;
+	if (!PAGE_SAFE(s, 8)) return memcmp(lex_kw[h].s, s, n) ? LEX_ID : lex_kw[h].type;
+	u64 w, k;
+	memcpy(&w, s, 8);
+	memcpy(&k, lex_kw[h].s, 8);
+	return (w & (~(u64)0 >> (64 - 8*n))) == k ? lex_kw[h].type : LEX_ID;
+}
+
+#ifdef __SSE2__
+#define LOAD(s) _mm_loadu_si128((const __m128i*)(s))
+#define EQ(v, c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+#define IN(v, lo, hi) _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo)-1)), \
+	_mm_cmplt_epi8(v, _mm_set1_epi8((hi)+1)))
+#endif
+
+OVERREAD static char *scan_id(char *s) {
+	for (int i = 0; i < 8; i++, s++) if (!IS(*s, C_ID)) return s; // mostly short
+#ifdef __SSE2__
+	while (PAGE_SAFE(s, 16)) {
+		__m128i v = LOAD(s), l = _mm_or_si128(v, _mm_set1_epi8(0x20)); // folds case
+		__m128i m = _mm_or_si128(_mm_or_si128(IN(l, 'a', 'z'), IN(v, '0', '9')), EQ(v, '_'));
+		u32 end = ~_mm_movemask_epi8(m) & 0xffff;
+		if (end) return s + __builtin_ctz(end);
+		s += 16;
+	}
+#endif
+	while (IS(*s, C_ID)) s++;
+	return s;
+}
+
+OVERREAD static char *scan_blanks(char *s) {
+	if (!IS(*s, C_BLANK)) return s; // mostly single
+#ifdef __SSE2__
+	while (PAGE_SAFE(s, 16)) {
+		__m128i v = LOAD(s);
+		__m128i m = _mm_or_si128(_mm_or_si128(EQ(v, ' '), EQ(v, '\t')), _mm_or_si128(EQ(v, '\r'), EQ(v, '\n')));
+		u32 end = ~_mm_movemask_epi8(m) & 0xffff;
+		if (end) return s + __builtin_ctz(end);
+		s += 16;
+	}
+#endif
+	while (IS(*s, C_BLANK)) s++;
+	return s;
+}
+
+// to the end of the line or the source
+OVERREAD static char *scan_line(char *s) {
+#ifdef __SSE2__
+	while (PAGE_SAFE(s, 16)) {
+		__m128i v = LOAD(s);
+		u32 end = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(EQ(v, '\r'), EQ(v, '\n')), EQ(v, 0)));
+		if (end) return s + __builtin_ctz(end);
+		s += 16;
+	}
+#endif
+	while (*s && *s != '\r' && *s != '\n') s++;
+	return s;
+}
+
+// 0x1f, 0x.8, 0x1.8p-3, s is past the 0x
+static char *scan_hex(char *s) {
+	while (IS(*s, C_HEX)) s++;
+	if (*s == '.') {
+		s++;
+		while (IS(*s, C_HEX)) s++;
+	}
+	if (*s == 'p' || *s == 'P') {
+		s++;
+		if (*s == '-' || *s == '+') s++;
+		while (IS(*s, C_DIGIT)) s++;
+	}
+	return s;
+}
+
+// blanks and comments are skipped, t->s is where the token starts
 int lex(char *s, token *t) {
 	int dot = 0;
+	u8 k;
+	for (;;) {
+		k = lex_class[(u8)*s];
+		if (k & C_BLANK) s = scan_blanks(s + 1);
+		else if (*s == '-' && s[1] == '-') s = scan_line(s + 2);
+		else break;
+	}
 	t->s = s;
-	switch(*s++) {
-	case ' ': case '\t': case '\r': case '\n':
-		while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') s++;
-		t->type = LEX_BLANKS;
-		break;
+
+	if ((k & (C_ID | C_DIGIT)) == C_ID) {
+		s = scan_id(s + 1);
+		t->type = lex_keyword(t->s, s - t->s);
+	} else if (*s == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		s = scan_hex(s + 2);
+		t->type = LEX_NUM;
+	} else if (k & C_DIGIT) {
+		s++;
+		goto lex_num;
+	} else switch(*s++) {
 	case '.':
 		dot = 1;
 		if (*s == '.' && s[1] == '.') {
@@ -21,196 +171,28 @@ int lex(char *s, token *t) {
 		} else if (*s == '.') {
 			t->type = LEX_CAT;
 			break;
-		} else if (!isdigit(*s)) {
+		} else if (!IS(*s, C_DIGIT)) {
 			t->type = '.';
 			break;
 		}
-	case '0': case '1': case '2': case '3': case '4': case '5':
-	case '6': case '7': case '8': case '9':
-		while (isdigit(*s)) s++;
+lex_num:
+		while (IS(*s, C_DIGIT)) s++;
 		if (*s == '.' && !dot) {
 			s++;
-			while (isdigit(*s)) s++;
+			while (IS(*s, C_DIGIT)) s++;
 		}
 		if (*s == 'e' || *s == 'E') {
 			s++;
 			if (*s == '-' || *s == '+') s++;
-			while (isdigit(*s)) s++;
+			while (IS(*s, C_DIGIT)) s++;
 		}
 		t->type = LEX_NUM;
 		break;
-	case 'a':
-		if (*s == 'n' && s[1] == 'd') {
-			s+=2;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_AND;
-			break;
-		}
-		goto lex_id;
-	case 'b':
-		if (*s == 'r' && s[1] == 'e' && s[2] == 'a' && s[3] == 'k') {
-			s+=4;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_BREAK;
-			break;
-		}
-		goto lex_id;
-	case 'd':
-		if (*s == 'o') {
-			s++;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_DO;
-			break;
-		}
-		goto lex_id;
-	case 'e':
-		if (*s == 'l' && s[1] == 's' && s[2] == 'e') {
-			s+=3;
-			if (*s == 'i' && s[1] == 'f' && !VALID(s[2])) {
-				s+=2;
-				t->type = LEX_ELSEIF;
-				break;
-			}
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_ELSE;
-			break;
-		}
-		if (*s == 'n' && s[1] == 'd') {
-			s+=2;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_END;
-			break;
-		}
-		goto lex_id;
-	case 'f':
-		if (*s == 'o' && s[1] == 'r') {
-			s+=2;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_FOR;
-			break;
-		}
-		if (*s == 'a' && s[1] == 'l' && s[2] == 's' && s[3] == 'e') {
-			s+=4;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_FALSE;
-			break;
-		}
-		if (*s == 'u' && s[1] == 'n' && s[2] == 'c' && s[3] == 't' && s[4] == 'i' && s[5] == 'o' && s[6] == 'n') {
-			s+=7;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_FUNCTION;
-			break;
-		}
-		goto lex_id;
-	case 'i':
-		if (*s == 'f') {
-			s++;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_IF;
-			break;
-		}
-		if (*s == 'n') {
-			s++;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_IN;
-			break;
-		}
-		goto lex_id;
-	case 'l':
-		if (*s == 'o' && s[1] == 'c' && s[2] == 'a' && s[3] == 'l') {
-			s+=4;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_LOCAL;
-			break;
-		}
-		goto lex_id;
-	case 'o':
-		if (*s == 'r') {
-			s++;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_OR;
-			break;
-		}
-		goto lex_id;
-	case 'n':
-		if (*s == 'o' && s[1] == 't') {
-			s+=2;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_NOT;
-			break;
-		}
-		if (*s == 'i' && s[1] == 'f') {
-			s+=2;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_NIL;
-			break;
-		}
-		goto lex_id;
-	case 'r':
-		if (*s == 'e' && s[1] == 'p' && s[2] == 'e' && s[3] == 'a' && s[4] == 't') {
-			s+=5;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_REPEAT;
-			break;
-		}
-		if (*s == 'e' && s[1] == 't' && s[2] == 'u' && s[3] == 'r' && s[4] == 'n') {
-			s+=5;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_RETURN;
-			break;
-		}
-		goto lex_id;
-	case 't':
-		if (*s == 'h' && s[1] == 'e' && s[2] == 'n') {
-			s+=3;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_THEN;
-			break;
-		}
-		if (*s == 'r' && s[1] == 'u' && s[2] == 'e') {
-			s+=3;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_TRUE;
-			break;
-		}
-		goto lex_id;
-	case 'u':
-		if (*s == 'n' && s[1] == 't' && s[2] == 'i' && s[3] == 'l') {
-			s+=4;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_UNTIL;
-			break;
-		}
-		goto lex_id;
-	case 'w':
-		if (*s == 'h' && s[1] == 'i' && s[2] == 'l' && s[3] == 'e') {
-			s+=4;
-			if (VALID(*s)) goto lex_id;
-			t->type = LEX_WHILE;
-			break;
-		}
-		goto lex_id;
-	case 'c': case 'g': case 'h': case 'j': case 'k': case 'm':
-	case 'p': case 'q': case 's': case 'v': case 'x': case 'y':
-	case 'z':
-	case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-	case 'G': case 'H': case 'I': case 'J': case 'K': case 'L':
-	case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R':
-	case 'S': case 'T': case 'U': case 'V': case 'W': case 'X':
-	case 'Y': case 'Z': case '_':
-		goto lex_id;
 	case '\'': case '\"':
 		while (*s != *t->s) s++;
 		t->type = LEX_STR;
 		s++;
 		break;
-	case '-':
-		if (*s != '-') t->type = *t->s;
-		else {
-			while (*s && *s != '\r' && *s != '\n') s++;
-			t->type = LEX_COMMENT;
-		}
-		break;
 	case '~':
 		if (*s != '=') return 1;
 		t->type = LEX_NE;
@@ -234,7 +216,7 @@ int lex(char *s, token *t) {
 			s++;
 		} else t->type = '=';
 		break;
-	case '^': case '%': case '+': case '*': case '/': case ',': case ';':
+	case '^': case '%': case '+': case '-': case '*': case '/': case ',': case ';':
 	case '(': case ')': case '[': case ']': case '{': case '}': case '#':
 		t->type = *t->s;
 		break;
@@ -243,11 +225,4 @@ int lex(char *s, token *t) {
 
 	t->length = s - t->s;
 	return 0;
-
-lex_id:
-	while (VALID(*s)) s++;
-	t->type = LEX_ID;
-	t->length = s - t->s;
-	return 0;
 }
-
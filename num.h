@@ -0,0 +1,13 @@
+#ifndef NUM_H
+#define NUM_H
+
+#include "common.h"
+
+/*
+ * Number literals: decimal (123, 1.5e-3, .5) and hex (0xff, 0x1.8p3), read
+ * straight from the span of len chars, no terminator needed. Correctly
+ * rounded. 0 on success, 1 if the span is not a whole numeral.
+ */
+int num_parse(const char *s, int len, double *out);
+
+#endif // NUM_H
@@ -2,6 +2,7 @@
 #include "ir.h"
 #include "lapi.h"
 #include "lex.h"
+#include "num.h"
 #include "value.h"
 #include "vector.h"
 
@@ -15,6 +16,7 @@
 
 #define MAX_KEY 256
 #define MAX_ARGS 256
+#define MAX_SETLIST 64 // positional constructor fields stored per batch
 
 #define PARSE_NONE INT_MIN
 
@@ -28,7 +30,7 @@ static void parser_phi_begin(parser *p, int type) {
 
 static int parser_phi_commit(parser *p) {
 	p->cdepth--;
-	return ir_phi_commit(p->c, p->assignment);
+	return ir_phi_commit(p->c);
 }
 
 typedef struct {
@@ -68,7 +70,7 @@ static void parser_exit(parser *p) {
 		char key[MAX_KEY];
 		memcpy(key+1, p->scopep->s, p->scopep->length);
 		key[0] = p->depth;
-		rhhm_remove_str(&p->sym, key, p->scopep->length+1);
+		gphm_remove_str(&p->sym, key, p->scopep->length+1);
 		p->scopep--;
 	}
 	p->depth--;
@@ -83,7 +85,7 @@ static int parser_sym(parser *p, const char *id, int len) {
 	int d = p->depth;
 	do {
 		key[0] = d;
-		int r = rhhm_get_str(&p->sym, key, len+1);
+		int r = gphm_get_str(&p->sym, key, len+1);
 		if (r >= 0) return r;
 	} while (d-- > 0);
 	return -1;
@@ -103,17 +105,23 @@ static int parser_newsym(parser *p, char *id, int len) {
 
 	int r = ir_newvar(p->c);
 
-	p->sym_cdepth[r] = p->cdepth;
+	vget(p->c->sym_cdepth, r) = p->cdepth;
 
-	rhhm_insert_str(&p->sym, key, len+1, r);
+	gphm_insert_str(&p->sym, key, len+1, r);
 	return r;
 }
 
+// global cell of name, as a constant
+static int parser_global(parser *p, char *s, int len) {
+	bv *cell = lua_globalcell(p->L, lua_intern(p->L, s, len));
+	if (!cell) lua_error(p->L); // out of memory, fails the load
+	return ir_ctt(p->c, bv_make_ptr(cell));
+}
+
 static int parser_next(parser *p);
 
 int parser_init(parser *p, state *L, ir *I, char *s) {
-	if (rhhm_init(&p->sym, PARSER_SYM_MAX*2, 0)) return 1;
-	memset(p->assignment, 0, sizeof(u16) * IR_OP_MAX);
+	if (gphm_init(&p->sym, PARSER_SYM_INITIAL_SZ, L->strseed ^ L->strseed >> 32)) return 1;
 
 	p->c = I;
 	p->b = p->s = s;
@@ -126,14 +134,12 @@ int parser_init(parser *p, state *L, ir *I, char *s) {
 }
 
 void parser_destroy(parser *p) {
-	rhhm_destroy(&p->sym);
+	gphm_destroy(&p->sym);
 }
 
 static int parser_next(parser *p) {
-	do {
-		if (lex(p->s, &p->current)) return 1;
-		p->s += p->current.length;
-	} while (TP == LEX_BLANKS || TP == LEX_COMMENT);
+	if (lex(p->s, &p->current)) return 1;
+	p->s = TK.s + TK.length;
 
 	printf(" next token '%.*s'\n", TK.length, TK.s);
 
@@ -144,6 +150,21 @@ static int parser_check(parser *p, int tp) {
 	return p->current.type == tp ? 0 : 1;
 }
 
+// points at the current token and quits
+static void parser_fail(parser *p) {
+	char *bol = TK.s;
+	while (*bol != '\r' && *bol != '\n' && bol != p->b) bol--;
+	if (bol != p->b) bol++;
+	char *cur = bol;
+	while (*cur && *cur != '\r' && *cur != '\n') printf("%c", *cur++);
+	printf("\n");
+	for (int i = 0; i < TK.s - bol; i++) printf(" ");
+	printf("^");
+	for (int i = 1; i < TK.length; i++) printf("~");
+	puts("");
+	exit(1); // TODO: that was harsh
+}
+
 static void parser_expect(parser *p, int tp) {
 	if (p->current.type != tp) {
 		printf("unexpected token '%.*s' @ %ld, expecting '", TK.length, TK.s, TK.s-p->b);
@@ -157,18 +178,7 @@ static void parser_expect(parser *p, int tp) {
 		case LEX_IN: printf("in"); break;
 		}
 		puts("'");
-
-		char *bol = TK.s;
-		while (*bol != '\r' && *bol != '\n' && bol != p->b) bol--;
-		if (bol != p->b) bol++;
-		char *cur = bol;
-		while (*cur && *cur != '\r' && *cur != '\n') printf("%c", *cur++);
-		printf("\n");
-		for (int i = 0; i < TK.s - bol; i++) printf(" ");
-		printf("^");
-		for (int i = 1; i < TK.length; i++) printf("~");
-		puts("");
-		exit(1); // TODO: that was harsh
+		parser_fail(p);
 	}
 }
 
@@ -198,14 +208,19 @@ static pfield parse_field(parser *p) {
 		EXPECT('=');
 		f.b = parse_expr(p);
 		break;
-	case LEX_ID:
-		f.tp = 2;
-		//f.a = parse_primary(p);
-		f.a = ir_ctt(p->c, lua_intern(p->L, TK.s, TK.length));
+	case LEX_ID: {
+		parser_state state = parser_save(p);
+		token t = TK;
 		NEXT();
-		EXPECT('=');
-		f.b = parse_expr(p);
-		break;
+		if (TP == '=') {
+			f.tp = 2;
+			f.a = ir_ctt(p->c, lua_intern_fixed(p->L, t.s, t.length));
+			NEXT();
+			f.b = parse_expr(p);
+			break;
+		}
+		parser_restore(p, state); // positional
+		} // fallthrough
 	default:
 		f.tp = 1;
 		f.a = parse_expr(p);
@@ -213,38 +228,53 @@ static pfield parse_field(parser *p) {
 	return f;
 }
 
-static int parse_table(parser *p) {
-	int r = EMIT_OP(IR_OP_NEWTBL, 0, 0, ir_newvar(p->c));
-	EXPECT('{');
-	if (TP == '}') { // empty table
-		NEXT();
-		return r;
-	}
+// store pending positional fields ending at index narr in one go
+static void parse_setlist(parser *p, int r, int *vals, int n, int narr) {
+	EMIT_OP(IR_OP_ARG, ir_ctt(p->c, bv_make_double(narr-n+1)), IR_NO_ARG, IR_NO_TARGET);
+	for (int i = 0; i < n; i++)
+		EMIT_OP(IR_OP_ARG, vals[i], IR_NO_ARG, IR_NO_TARGET);
+	EMIT_OP(IR_OP_TSETLIST, r, n, IR_NO_TARGET);
+}
 
+static int parse_table(parser *p) {
+	int newtbl = ir_current(p->c);
+	int r = EMIT_OP(IR_OP_NEWTBL, IR_NO_ARG, IR_NO_ARG, ir_newvar(p->c));
+	int narr = 0, nhash = 0, nslots = 0, vals[MAX_SETLIST], n = 0;
 	pfield f;
-again:
-	f = parse_field(p); // at least one field
-	if (f.tp == 2) {
-		EMIT_OP(IR_OP_TSTORE, f.a, f.b, r);
-	} else {
-		// TODO
-	}
 
-	if (TP != ',' && TP != ';') {
-		EXPECT('}');
-		return r;
+	EXPECT('{');
+	while (TP != '}') {
+		f = parse_field(p);
+		if (f.tp == 2) {
+			EMIT_OP(IR_OP_TSTORE, f.a, f.b, r);
+			if (f.a < 0 && shape_is_key(vget(p->c->ctts, -f.a-1))) nslots++;
+			else nhash++;
+		} else {
+			vals[n++] = f.a;
+			narr++;
+			if (n == MAX_SETLIST) {
+				parse_setlist(p, r, vals, n, narr);
+				n = 0;
+			}
+		}
+
+		if (TP != ',' && TP != ';') break;
+		NEXT();
 	}
-	NEXT();
-	if (TP != '}') goto again;
+	EXPECT('}');
+	if (n) parse_setlist(p, r, vals, n, narr);
 
-	NEXT();
+	if (nslots > SHAPE_MAX_SLOTS) nhash += nslots; // shape is dropped
+	tac *t = &vget(p->c->ops, newtbl);
+	if (narr) t->a = ir_ctt(p->c, bv_make_double(narr));
+	if (nhash) t->b = ir_ctt(p->c, bv_make_double(nhash));
 	return r;
 }
 
 static int parse_param(parser *p) {
 	CHECK(LEX_ID);
 	int r = parser_newsym(p, TK.s, TK.length);
-	p->assignment[r] = r;
+	vget(p->c->assignment, r) = r;
 	NEXT();
 	return r;
 }
@@ -284,7 +314,7 @@ again:
 
 	EXPECT(LEX_END);
 	if (!local) {
-		int field = ir_ctt(p->c, lua_intern(p->L, t.s, t.length));
+		int field = parser_global(p, t.s, t.length);
 		r = EMIT_OP(IR_OP_GSTORE, field, r, IR_NO_TARGET); // target ignored
 	}
 	return r;
@@ -327,11 +357,11 @@ static int parse_id(parser *p) {
 	int r = parser_sym(p, TK.s, TK.length);
 
 	if (r == -1) { // global load
-		int field = ir_ctt(p->c, lua_intern(p->L, TK.s, TK.length));
+		int field = parser_global(p, TK.s, TK.length);
 		r = EMIT_OP(IR_OP_GLOAD, field, IR_NO_ARG, ir_newvar(p->c));
 	} else {
 		// get current SSA assignment
-		r = p->assignment[r];
+		r = vget(p->c->assignment, r);
 	}
 
 	NEXT();
@@ -353,25 +383,19 @@ static int parse_primary(parser *p) {
 	case LEX_FALSE: r = ir_ctt(p->c, bv_make_bool(0)); NEXT(); break;
 	case LEX_TRUE: r = ir_ctt(p->c, bv_make_bool(1)); NEXT(); break;
 	case LEX_STR:
-		r = ir_ctt(p->c, lua_intern(p->L, TK.s+1, TK.length-2));
+		r = ir_ctt(p->c, lua_intern_fixed(p->L, TK.s+1, TK.length-2));
 		NEXT();
 		break;
-	case LEX_NUM:
-		if (p->current.length >= 512) {
-			// TODO: explicit error here
-			r = ir_ctt(p->c, nil);
-		} else {
-			char tmp[512], *e;
-			memcpy(tmp, p->current.s, p->current.length);
-			tmp[p->current.length] = '\0';
-			double val = strtod(tmp, &e);
-			if (*e) {
-				// TODO handle conversion failure
-			}
-			r = ir_ctt(p->c, bv_make_double(val));
+	case LEX_NUM: {
+		double val;
+		if (num_parse(TK.s, TK.length, &val)) {
+			printf("malformed number '%.*s' @ %ld\n", TK.length, TK.s, TK.s-p->b);
+			parser_fail(p);
 		}
+		r = ir_ctt(p->c, bv_make_double(val));
 		NEXT();
 		break;
+	}
 	case '{':
 		r = parse_table(p);
 		break;
@@ -387,15 +411,22 @@ static int parse_primary(parser *p) {
 	}
 
 
-	while (TP == '.') {
-		NEXT();
-		EXPECT(LEX_ID);
-
-		int field = ir_ctt(p->c, lua_intern(p->L, TK.s, TK.length));
+	while (TP == '.' || TP == '[' || TP == '(') {
+		int field;
+		if (TP == '(') { // t.f(...)
+			r = parse_call(p, r);
+			continue;
+		} else if (TP == '.') {
+			NEXT();
+			CHECK(LEX_ID);
+			field = ir_ctt(p->c, lua_intern_fixed(p->L, TK.s, TK.length));
+			NEXT();
+		} else {
+			NEXT();
+			field = parse_expr(p);
+			EXPECT(']');
+		}
 		r = EMIT_OP(IR_OP_TLOAD, r, field, ir_newvar(p->c));
-		
-
-		NEXT();
 	}
 
 	return r;
@@ -462,7 +493,7 @@ static int parse_assignment(parser *p, int local) {
 	if (local) {
 		if (TP == '=') {
 			r = parser_newsym(p, t.s, t.length);
-			n = p->assignment[r] = r;
+			n = vget(p->c->assignment, r) = r;
 			
 			NEXT();
 			a = parse_expr(p);
@@ -484,24 +515,24 @@ static int parse_assignment(parser *p, int local) {
 	if (TP == '=') { // global or redef
 		r = parser_sym(p, t.s, t.length);
 		if (r == -1) { // global
-			field = ir_ctt(p->c, lua_intern(p->L, t.s, t.length));
+			field = parser_global(p, t.s, t.length);
 			n = r = ir_newvar(p->c);
-			p->assignment[r] = r;
+			vget(p->c->assignment, r) = r;
 		} else {
 			local = 1;
 
 			n = ir_newvar(p->c);
 
-			int old = p->assignment[r];
-			p->assignment[n] = r;
+			int old = vget(p->c->assignment, r);
+			vget(p->c->assignment, n) = r;
 
-			p->sym_cdepth[n] = p->cdepth;
+			vget(p->c->sym_cdepth, n) = p->cdepth;
 
-			if (p->cdepth > 0 && p->sym_cdepth[old] < p->cdepth) {
-				ir_phi_ins(p->c, n, old, p->assignment);
-				p->sym_cdepth[n] = p->sym_cdepth[old];
+			if (p->cdepth > 0 && vget(p->c->sym_cdepth, old) < p->cdepth) {
+				ir_phi_ins(p->c, n, old);
+				vget(p->c->sym_cdepth, n) = vget(p->c->sym_cdepth, old);
 			}
-			p->assignment[r] = n;
+			vget(p->c->assignment, r) = n;
 		}
 		NEXT();
 		a = parse_expr(p);
@@ -519,6 +550,14 @@ static int parse_assignment(parser *p, int local) {
 	r = parse_expr(p);
 	if (TP == '=') {
 		NEXT();
+		tac *l = &vback(p->c->ops);
+		if (l->op == IR_OP_TLOAD && l->target == r) { // t.k = v, t[k] = v
+			int tbl = l->a;
+			field = l->b;
+			(void)vpop(p->c->ops);
+			a = parse_expr(p);
+			return EMIT_OP(IR_OP_TSTORE, field, a, tbl);
+		}
 		a = parse_expr(p);
 		return EMIT_OP(IR_OP_LCOPY, a, IR_NO_ARG, r);
 	}
@@ -545,14 +584,14 @@ static int parse_if(parser *p) {
 		if (TP == LEX_ELSEIF) elif = 1;
 
 		// restore current assignments, and backup
-		int i = p->c->iphi;
+		int i = vsize(p->c->phis) - 1;
 		int tmp = i;
-		while (vget(p->c->ops, i).op != IR_OP_NOOP) {
-			int old = vget(p->c->ops, i).b;
-			p->assignment[old] = old;
-			vget(p->c->ops, i).target = vget(p->c->ops, i).a; // backup
-			vget(p->c->ops, i).a = old;
-			i++;
+		while (vget(p->c->phis, i).op != IR_OP_NOOP) {
+			int old = vget(p->c->phis, i).b;
+			vget(p->c->assignment, old) = old;
+			vget(p->c->phis, i).target = vget(p->c->phis, i).a; // backup
+			vget(p->c->phis, i).a = old;
+			i--;
 		}
 
 		b = ir_current(p->c); // so we can fix jz target later
@@ -570,11 +609,11 @@ static int parse_if(parser *p) {
 		c = b;
 
 		i = tmp;
-		while (vget(p->c->ops, i).op != IR_OP_NOOP) {
-			int old = vget(p->c->ops, i).b;
-			vget(p->c->ops, i).b = vget(p->c->ops, i).target;
-			vget(p->c->ops, i).target = old;
-			i++;
+		while (vget(p->c->phis, i).op != IR_OP_NOOP) {
+			int old = vget(p->c->phis, i).b;
+			vget(p->c->phis, i).b = vget(p->c->phis, i).target;
+			vget(p->c->phis, i).target = old;
+			i--;
 		}
 	}
 
@@ -658,7 +697,7 @@ static int parse_for(parser *p) {
 		int nvar = ir_newvar(p->c);
 		a = EMIT_OP(IR_OP_LCOPY, a, IR_NO_ARG, nvar);
 	}
-	p->assignment[a] = a;
+	vget(p->c->assignment, a) = a;
 
 	EXPECT(',');
 	b = parse_expr(p);
@@ -671,7 +710,7 @@ static int parse_for(parser *p) {
 	}
 
 	r = parser_newsym(p, t.s, t.length);
-	n = p->assignment[r] = r;
+	n = vget(p->c->assignment, r) = r;
 
 	int fix = ir_current(p->c); // so we can fix jz target later
 	EMIT_OP(IR_OP_JE, a, b, 0);
@@ -680,7 +719,7 @@ static int parse_for(parser *p) {
 
 	// create local iterator var
 	int v = parser_newsym(p, t.s, t.length);
-	p->assignment[v] = v;
+	vget(p->c->assignment, v) = v;
 	v = EMIT_OP(IR_OP_LCOPY, a, IR_NO_ARG, v);
 
 	EXPECT(LEX_DO);
@@ -688,10 +727,10 @@ static int parse_for(parser *p) {
 	EXPECT(LEX_END);
 
 	int na = ir_newvar(p->c);
-	int old = p->assignment[a];
-	p->assignment[na] = a;
-	ir_phi_ins(p->c, na, old, p->assignment);
-	p->assignment[a] = na;
+	int old = vget(p->c->assignment, a);
+	vget(p->c->assignment, na) = a;
+	ir_phi_ins(p->c, na, old);
+	vget(p->c->assignment, a) = na;
 
 	EMIT_OP('+', a, c, na);
 	EMIT_OP(IR_OP_JNE, na, b, header);
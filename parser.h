@@ -4,11 +4,12 @@
 #include "common.h"
 #include "lex.h"
 #include "ir.h"
+#include "gphm.h"
 #include "rhhm.h"
 
 typedef struct state state;
 
-#define PARSER_SYM_MAX (1<<12)
+#define PARSER_SYM_INITIAL_SZ 64
 #define PARSER_MAX_REC_DEPTH (1<<8) /* TODO */
 
 typedef struct {
@@ -19,18 +20,16 @@ typedef struct {
 	char *s;
 	token current;
 
-	// symbols
-	rhhm sym;
+	// symbols, lookups miss once per enclosing scope
+	gphm sym;
 
 	// lexical scope
 	token scope[128]; // lexical scope undo stack
 	token *scopep;
 	int depth;
 
-	// ssa - TODO: extract to ir?
-	u8 sym_cdepth[IR_OP_MAX];  // symbol depth
-	int cdepth;                // phi depth
-	u16 assignment[IR_OP_MAX]; // current assignment
+	// ssa, assignments and symbol depths are kept per var in ir
+	int cdepth; // phi depth
 
 	// ir
 	ir *c;
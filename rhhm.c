@@ -3,16 +3,9 @@
 
 #include <string.h>
 
-#define DISTANCE(p, h) (p >= h ? p-h : p + (hm->data->cap - h))
-
-static u32 djb2(u8 *key, u32 len) {
-	u32 hash = 5381, i;
-	for (i = 0; i < len; i++) {
-		u32 c = key[i];
-		hash = ((hash << 5) + hash) + c;
-	}
-	return hash;
-}
+#define DISTANCE(d, p, h) (p >= h ? p-h : p + (d->cap - h))
+#define ENTRY_HASH(d, e) (hfn((e).key, (d)->hash) & (d->cap - 1))
+#define NEXT(d, i) (((i)+1)&(d->cap-1))
 
 static int rhhm_is_initialized(rhhm *hm) {
 	return (((u64)hm->data) & 0x2) ? 0 : 1;
@@ -24,119 +17,267 @@ static u32 rhhm_hash(rhhm *hm) {
 	return ((u64)hm->data) >> 32; 
 }
 
+static int rhhm_value_empty(rhhm_value *v) {
+	return v->value.u == bv_none;
+}
+
+static void *malloc_alloc(void *ctx, void *owner, size_t sz) { return ML_MALLOC(sz); }
+static void *malloc_realloc(void *ctx, void *owner, void *p, size_t old, size_t sz) { return ML_REALLOC(p, sz); }
+static void malloc_free(void *ctx, void *p, size_t sz) { ML_FREE(p); }
+
+const ml_allocator ml_malloc_allocator = { malloc_alloc, malloc_realloc, malloc_free, NULL };
+__thread ml_allocator ml_payload = { malloc_alloc, malloc_realloc, malloc_free, NULL };
+
+void *ml_default_alloc(void *ud, void *p, size_t osize, size_t nsize) {
+	if (nsize) return ML_REALLOC(p, nsize);
+	ML_FREE(p);
+	return NULL;
+}
+
+#define PAYLOAD_FREE(d) ml_payload.free(ml_payload.ctx, d, RHHM_DATA_SZ((d)->cap))
+
+static rhhm_data *rhhm_data_new(rhhm *hm, u32 cap, u32 hash, u32 max_load) {
+	rhhm_data *d = ml_payload.alloc(ml_payload.ctx, hm, RHHM_DATA_SZ(cap));
+	if (!d) return NULL;
+
+	d->cap = cap;
+	d->hash = hash;
+	d->sz = 0;
+	d->max_load = max_load;
+	d->old = NULL;
+	d->migrated = 0;
+
+	do d->table[--cap].value.u = bv_none; while (cap);
+
+	return d;
+}
+
 static int rhhm_maybe_initialize(rhhm *hm) {
 	if (rhhm_is_initialized(hm)) return 0;
 
 	u32 cap = ((u64)hm->data) & 0xfffffffc;
 	u32 hash = ((u64)hm->data) >> 32; 
 
-	hm->data = ML_MALLOC(sizeof(rhhm_data) + (cap-1) * sizeof(rhhm_value));
-	if (!hm->data) return 1;
+	rhhm_data *d = rhhm_data_new(hm, cap, hash, RHHM_MAX_LOAD_DEFAULT);
+	if (!d) return 1;
+	hm->data = d;
+
+	return 0;
+}
+
+static rhhm_value *data_find(rhhm_data *d, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
+	u32 i, h; i = h = hfn(key, d->hash) & (d->cap-1);
+	while (!rhhm_value_empty(d->table+i)) {
+		if (DISTANCE(d, i, ENTRY_HASH(d, d->table[i])) < DISTANCE(d, i, h)) return NULL;
+		if (!cfn(d->table[i].key, key)) return d->table+i;
+		i = NEXT(d, i);
+	}
+	return NULL;
+}
+
+// returns 1 if a new slot was taken
+static int data_insert(rhhm_data *d, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value) {
+	rhhm_value entry, tmp;
+	entry.key = key;
+	entry.value = value;
+	u32 i = ENTRY_HASH(d, entry);
+	u32 entry_hash = i;
+	while (!rhhm_value_empty(d->table+i) &&
+		DISTANCE(d, i, entry_hash) <= DISTANCE(d, i, ENTRY_HASH(d, d->table[i]))) {
+		if (ENTRY_HASH(d, d->table[i]) == entry_hash &&
+			!cfn(d->table[i].key, key)) {
+			d->table[i].value = entry.value;
+			return 0;
+		}
+		i = NEXT(d, i);
+	}
+	d->sz++;
+	tmp = entry;
+	entry = d->table[i];
+	d->table[i] = tmp;
+
+	while (!rhhm_value_empty(&entry)) { // carry the displaced entry on from i
+		entry_hash = ENTRY_HASH(d, entry);
+		do i = NEXT(d, i);
+		while (!rhhm_value_empty(d->table+i) &&
+			DISTANCE(d, i, entry_hash) <= DISTANCE(d, i, ENTRY_HASH(d, d->table[i])));
+		tmp = entry;
+		entry = d->table[i];
+		d->table[i] = tmp;
+	}
+	return 1;
+}
+
+// backward shift deletion, returns 1 if the key was found
+static int data_remove(rhhm_data *d, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
+	rhhm_value *v = data_find(d, hfn, cfn, key);
+	if (!v) return 0;
+
+	u32 i = v - d->table, j = NEXT(d, i);
+	while (!rhhm_value_empty(d->table+j) &&
+		DISTANCE(d, j, ENTRY_HASH(d, d->table[j])) != 0) {
+		d->table[i] = d->table[j];
+		i = j;
+		j = NEXT(d, j);
+	}
+	d->table[i].value.u = bv_none;
+	d->sz--;
+	return 1;
+}
+
+// tombstone 'old' copy of key, so it is neither found nor migrated again
+static void data_kill_old(rhhm_data *d, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
+	rhhm_value *v = data_find(d->old, hfn, cfn, key);
+	if (v) v->value = nil;
+}
+
+// moves live src buckets [i, end) into dst, leaving tombstones behind
+static void data_drain(rhhm_data *dst, rhhm_data *src, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, u32 i, u32 end) {
+	for (; i < end; i++) {
+		rhhm_value *v = src->table + i;
+		if (rhhm_value_empty(v) || bv_is_nil(v->value)) continue;
+		data_insert(dst, hfn, cfn, v->key, v->value);
+		v->value = nil;
+	}
+}
+
+static void rhhm_migrate(rhhm_data *d, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, u32 n) {
+	rhhm_data *old = d->old;
+	if (!old) return;
+
+	u32 end = old->cap - d->migrated > n ? d->migrated + n : old->cap;
+	data_drain(d, old, hfn, cfn, d->migrated, end);
+	d->migrated = end;
 
-	hm->data->cap = cap;
-	hm->data->hash = hash;
+	if (d->migrated == old->cap) {
+		PAYLOAD_FREE(old);
+		d->old = NULL;
+		d->migrated = 0;
+	}
+}
 
-	do hm->data->table[--cap].value.u = bv_none; while (cap);
+static int rhhm_resize(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, u32 cap) {
+	rhhm_data *d = hm->data;
+	rhhm_data *n = rhhm_data_new(hm, cap, d->hash, d->max_load);
+	if (!n) return 1;
 
+	if (d->old) { // writes outran migration, move leftovers straight to n
+		data_drain(n, d->old, hfn, cfn, d->migrated, d->old->cap);
+		PAYLOAD_FREE(d->old);
+		d->old = NULL;
+		d->migrated = 0;
+	}
+
+	n->old = d;
+	hm->data = n;
+
+	rhhm_migrate(n, hfn, cfn, RHHM_MIGRATE_STEP);
 	return 0;
 }
 
-static int rhhm_value_empty(rhhm_value *v) {
-	return v->value.u == bv_none;
+static int rhhm_overloaded(rhhm_data *d) {
+	return (u64)(d->sz+1) * 100 > (u64)d->cap * d->max_load;
+}
+
+static int rhhm_underloaded(rhhm_data *d) {
+	return d->cap > RHHM_MIN_CAP && (u64)d->sz * 400 < (u64)d->cap * d->max_load;
 }
 
 // length must be a power of two, also >= 4
 int rhhm_init(rhhm *hm, u32 length, u32 hash) {
-	hm->data = (rhhm_data*)((((u64)hash) << 32) | length | 0x2);
+	hm->data = RHHM_LAZY(length, hash);
 	return 0;
 }
 
 void rhhm_destroy(rhhm *hm) {
-	if (rhhm_is_initialized(hm)) ML_FREE(hm->data);
+	if (!rhhm_is_initialized(hm) || !hm->data) return;
+	if (hm->data->old) PAYLOAD_FREE(hm->data->old);
+	PAYLOAD_FREE(hm->data);
 }
 
-#define ENTRY_HASH(e) (hfn(e.key) & (hm->data->cap - 1))
-void rhhm_set(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value) {
-	if (rhhm_maybe_initialize(hm)) return;
+int rhhm_set_max_load(rhhm *hm, u32 percent) {
+	if (rhhm_maybe_initialize(hm)) return 1;
+	if (percent < RHHM_MAX_LOAD_MIN) percent = RHHM_MAX_LOAD_MIN;
+	if (percent > RHHM_MAX_LOAD_MAX) percent = RHHM_MAX_LOAD_MAX;
+	hm->data->max_load = percent;
+	return 0;
+}
 
-	rhhm_value entry, tmp;
-	entry.key = key;
-	entry.value = value;
-	u32 i = ENTRY_HASH(entry);
-	u32 entry_hash = i;
-	while (!rhhm_value_empty(hm->data->table+i) &&
-		DISTANCE(i, entry_hash) <= DISTANCE(i, ENTRY_HASH(hm->data->table[i]))) {
-		if (ENTRY_HASH(hm->data->table[i]) == entry_hash &&
-			!cfn(hm->data->table[i].key, key)) {
-			hm->data->table[i].value = entry.value;
-			return;
+u32 rhhm_size(rhhm *hm) {
+	if (!rhhm_is_initialized(hm)) return 0;
+	rhhm_data *d = hm->data;
+	u32 sz = d->sz;
+	if (d->old) {
+		for (u32 i = d->migrated; i < d->old->cap; i++) {
+			rhhm_value *v = d->old->table + i;
+			if (!rhhm_value_empty(v) && !bv_is_nil(v->value)) sz++;
 		}
-		i = ((i+1)&(hm->data->cap-1));
-	}
-	tmp = entry;
-	entry = hm->data->table[i];
-	hm->data->table[i] = tmp;
-
-	while (!rhhm_value_empty(&entry)) {
-		u32 i = entry_hash = ENTRY_HASH(entry);
-		while (!rhhm_value_empty(hm->data->table+i) &&
-			DISTANCE(i, entry_hash) <= DISTANCE(i, ENTRY_HASH(hm->data->table[i]))) {
-			//if (++i >= hm->length) i = 0;
-			i = ((i+1)&(hm->data->cap-1));
-		}
-		tmp = entry;
-		entry = hm->data->table[i];
-		hm->data->table[i] = tmp;
 	}
+	return sz;
+}
+
+int rhhm_set(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value) {
+	if (rhhm_maybe_initialize(hm)) return 1;
+
+	rhhm_migrate(hm->data, hfn, cfn, RHHM_MIGRATE_STEP);
+	while (rhhm_overloaded(hm->data))
+		if (rhhm_resize(hm, hfn, cfn, hm->data->cap * 2)) return 1;
+
+	rhhm_data *d = hm->data;
+	if (d->old) data_kill_old(d, hfn, cfn, key);
+	data_insert(d, hfn, cfn, key, value);
+	return 0;
 }
-#include <stdio.h>
+
 bv rhhm_get(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
 	if (!rhhm_is_initialized(hm)) return nil;
 
-	u32 i, h; i = h = hfn(key) & (hm->data->cap-1);
-	while (!rhhm_value_empty(hm->data->table+i)) { // TODO: correctly return none
-		if (bv_is_nil(hm->data->table[i].value)) return nil; // TODO: check this
-		if (DISTANCE(i, ENTRY_HASH(hm->data->table[i])) < DISTANCE(i, h)) return nil;
-		if (!cfn(hm->data->table[i].key, key)) return hm->data->table[i].value;
-		//if (++i >= hm->length) i = 0;
-		i = ((i+1)&(hm->data->cap-1));
-	}
-	return nil;
+	rhhm_data *d = hm->data;
+	rhhm_migrate(d, hfn, cfn, RHHM_MIGRATE_STEP);
+
+	rhhm_value *v = data_find(d, hfn, cfn, key);
+	if (!v && d->old) v = data_find(d->old, hfn, cfn, key);
+	return v ? v->value : nil;
 }
 
 void rhhm_remove(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key) {
 	if (!rhhm_is_initialized(hm)) return;
 
-	u32 i, h; i = h = hfn(key) & (hm->data->cap-1);
-	while (!rhhm_value_empty(hm->data->table+i)) {
-		if (!cfn(hm->data->table[i].key, key)) {
-			u32 j = i;
-			do {
-				j = ((j+1)&(hm->data->cap-1));
-				hm->data->table[i] = hm->data->table[j];
-				i = j;
-			} while (!rhhm_value_empty(hm->data->table+j) &&
-				DISTANCE(j, ENTRY_HASH(hm->data->table[j])) != 0);
-			return;
-		}
-		if (ENTRY_HASH(hm->data->table[i]) < h) return;
-		i = ((i+1)&(hm->data->cap-1));
-	}
+	rhhm_data *d = hm->data;
+	rhhm_migrate(d, hfn, cfn, RHHM_MIGRATE_STEP);
+
+	if (d->old) data_kill_old(d, hfn, cfn, key);
+	data_remove(d, hfn, cfn, key);
+
+	if (!d->old && rhhm_underloaded(d))
+		rhhm_resize(hm, hfn, cfn, d->cap / 2);
+}
+
+void rhhm_settle(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn) {
+	if (rhhm_is_initialized(hm) && hm->data->old)
+		rhhm_migrate(hm->data, hfn, cfn, hm->data->old->cap);
 }
 
 void rhhm_visit(rhhm *hm, void *context, rhhm_visit_callback cb) {
 	if (!rhhm_is_initialized(hm)) return;
 
 	u32 i;
-	for (i = 0; i < hm->data->cap; i++)
-		if (!rhhm_value_empty(hm->data->table + i))
-			cb(context, hm->data->table + i);
+	rhhm_data *d = hm->data;
+	for (i = 0; i < d->cap; i++)
+		if (!rhhm_value_empty(d->table + i))
+			cb(context, d->table + i);
+
+	if (!d->old) return;
+	for (i = d->migrated; i < d->old->cap; i++)
+		if (!rhhm_value_empty(d->old->table + i))
+			cb(context, d->old->table + i);
 }
 
 
 // bv -> bv
-u32 rhhm_bb_hash(bv v) {
+u32 rhhm_bb_hash(bv v, u32 seed) {
 	// TODO: better hashing
+	if (bv_is_str(v)) return ((str*)bv_get_ptr(v))->hash;
 	return bv_is_tbl(v) ? rhhm_hash(bv_get_tbl(v)) : v.u ^ (v.u>>32);
 }
 
@@ -150,15 +291,11 @@ int hm_key_cmp(bv a, bv b) {
 	int alen = a.u >> 48;
 	int blen = b.u >> 48;
 	if (alen != blen) return 1;
-	return memcmp((void*)(a.u&bv_value_mask), (void*)(b.u&bv_value_mask), alen);
+	return str_cmp((void*)(a.u&bv_value_mask), (void*)(b.u&bv_value_mask), alen);
 }
 
-u32 hm_key_hash(bv a) {
-	int alen = a.u >> 48;
-
-	// TODO: better hash for big strings
-
-	return djb2((void*)(a.u&bv_value_mask), alen < 32 ? alen : 32);
+u32 hm_key_hash(bv a, u32 seed) {
+	return str_hash((void*)(a.u&bv_value_mask), a.u >> 48, seed);
 }
 
 
@@ -191,13 +328,16 @@ void rhhm_insert_cstr(rhhm *hm, const char *s, int val) {
 
 // interning hash impl
 
+// key being looked up, tagged with 1, strings in the pool carry the same hash
 typedef struct {
 	u32   len;
+	u32   hash;
 	char *data;
 } istr;
 
-int hm_sb_cmp(bv a, bv b) { // TODO: improve this -v-
+int hm_sb_cmp(bv a, bv b) {
 	if (!(a.u&1) && !(b.u&1)) return a.u == b.u ? 0 : 1;
+	if (hm_sb_hash(a, 0) != hm_sb_hash(b, 0)) return 1;
 
 	int alen = a.u & 1 ? ((istr*)(a.u & ~1ULL))->len : ((str*)bv_get_ptr(a))->sz;
 	int blen = b.u & 1 ? ((istr*)(b.u & ~1ULL))->len : ((str*)bv_get_ptr(b))->sz;
@@ -206,20 +346,18 @@ int hm_sb_cmp(bv a, bv b) { // TODO: improve this -v-
 
 	void *sa = a.u & 1 ? ((istr*)(a.u & ~1ULL))->data : ((str*)bv_get_ptr(a))->data;
 	void *sb = b.u & 1 ? ((istr*)(b.u & ~1ULL))->data : ((str*)bv_get_ptr(b))->data;
-	return memcmp(sa, sb, alen);
+	return str_cmp(sa, sb, alen);
 }
 
-u32 hm_sb_hash(bv a) {
-	int alen = a.u & 1 ? ((istr*)(a.u & ~1ULL))->len : ((str*)bv_get_ptr(a))->sz;
-	void *sa = a.u & 1 ? ((istr*)(a.u & ~1ULL))->data : ((str*)bv_get_ptr(a))->data;
-	// TODO: better hash for big strings
-	return djb2(sa, alen < 32 ? alen : 32);
+u32 hm_sb_hash(bv a, u32 seed) {
+	return a.u & 1 ? ((istr*)(a.u & ~1ULL))->hash : ((str*)bv_get_ptr(a))->hash;
 }
 
-bv hm_sb_get_str(rhhm *hm, char *s, int len) {
+bv hm_sb_get_str(rhhm *hm, char *s, int len, u32 hash) {
 	bv k;
 	istr is;
 	is.len = len;
+	is.hash = hash;
 	is.data = s;
 	k.u = (u64)(&is) | 1;
 	return hm_sb_get(hm, k);
@@ -6,8 +6,19 @@
 
 /*
  * Robin Hood Hashmap
- * TODO: resizing
+ *
+ * Tables grow (and shrink) incrementally: a resize allocates the new table and
+ * keeps the previous one in 'old', then every set/get/remove migrates at most
+ * RHHM_MIGRATE_STEP buckets. Until migration ends, lookups fall back to 'old';
+ * entries written or removed meanwhile get their 'old' copy tombstoned (nil
+ * value) so they are never migrated back.
  */
+#define RHHM_MIN_CAP 4
+#define RHHM_MIGRATE_STEP 16
+#define RHHM_MAX_LOAD_DEFAULT 85 // percent
+#define RHHM_MAX_LOAD_MIN 50
+#define RHHM_MAX_LOAD_MAX 95
+
 typedef struct {
 	bv value;
 	bv key;
@@ -16,6 +27,10 @@ typedef struct {
 typedef struct rhhm_data {
 	u32 cap;
 	u32 hash;
+	u32 sz;       // occupied slots
+	u32 max_load; // percent
+	struct rhhm_data *old; // being migrated, NULL when done
+	u32 migrated;          // next 'old' bucket to migrate
 	rhhm_value table[1];
 } rhhm_data;
 
@@ -23,15 +38,27 @@ typedef struct rhhm {
 	rhhm_data *data; // lsb reserved for GC
 } rhhm;
 
-typedef u32 (*rhhm_hash_fn)(bv);
+typedef u32 (*rhhm_hash_fn)(bv key, u32 seed); // seed: the hash the map was made with
 typedef int (*rhhm_cmp_fn)(bv, bv);
 
+// not yet allocated map, data is allocated on first use
+#define RHHM_LAZY(length, hash) ((rhhm_data*)((((u64)(hash)) << 32) | (length) | 0x2))
+#define RHHM_IS_LAZY(d) (((u64)(d)) & 0x2)
+#define RHHM_DATA_SZ(cap) (sizeof(rhhm_data) + ((cap)-1) * sizeof(rhhm_value))
+
 int  rhhm_init(rhhm *hm, u32 length, u32 hash);
 void rhhm_destroy(rhhm *hm);
 
-void rhhm_set(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value);
+// max load factor in percent, clamped to [RHHM_MAX_LOAD_MIN, RHHM_MAX_LOAD_MAX]
+int  rhhm_set_max_load(rhhm *hm, u32 percent);
+u32  rhhm_size(rhhm *hm);
+
+int  rhhm_set(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key, bv value); // 1: out of memory
 bv   rhhm_get(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key);
 void rhhm_remove(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn, bv key);
+// ends a pending migration: 'old' keeps the keys of dead entries, before
+// freeing what a key points to, settle the map
+void rhhm_settle(rhhm *hm, rhhm_hash_fn hfn, rhhm_cmp_fn cfn);
 
 
 typedef void(*rhhm_visit_callback)(void *context, rhhm_value *value);
@@ -39,16 +66,17 @@ void rhhm_visit(rhhm *hm, void *context, rhhm_visit_callback cb);
 
 
 // bv -> bv
-u32 rhhm_bb_hash(bv v);
+u32 rhhm_bb_hash(bv v, u32 seed);
 int rhhm_bb_cmp(bv a, bv b);
 
 #define hm_set(h,k,v)  rhhm_set   (h, rhhm_bb_hash, rhhm_bb_cmp, k, v)
 #define hm_get(h,k)    rhhm_get   (h, rhhm_bb_hash, rhhm_bb_cmp, k)
 #define hm_remove(h,k) rhhm_remove(h, rhhm_bb_hash, rhhm_bb_cmp, k)
 
-// string -> int
+// string -> int, only the compiler's maps use it. Keys hash with the map's
+// seed, give it one from the state (see parser_init)
 int hm_key_cmp(bv a, bv b);
-u32 hm_key_hash(bv a);
+u32 hm_key_hash(bv a, u32 seed);
 void rhhm_insert_str(rhhm *hm, const char *s, int len, int val);
 int rhhm_get_str(rhhm *hm, const char *s, int len);
 void rhhm_remove_str(rhhm *hm, const char *s, int len);
@@ -56,13 +84,14 @@ void rhhm_insert_cstr(rhhm *hm, const char *s, int val);
 
 // interning hash impl
 int hm_sb_cmp(bv a, bv b);
-u32 hm_sb_hash(bv a);
+u32 hm_sb_hash(bv a, u32 seed);
 
 #define hm_sb_set(h,k,v)  rhhm_set   (h, hm_sb_hash, hm_sb_cmp, k, v)
 #define hm_sb_get(h,k)    rhhm_get   (h, hm_sb_hash, hm_sb_cmp, k)
 #define hm_sb_remove(h,k) rhhm_remove(h, hm_sb_hash, hm_sb_cmp, k)
+#define hm_sb_settle(h)   rhhm_settle(h, hm_sb_hash, hm_sb_cmp)
 
-bv hm_sb_get_str(rhhm *hm, char *s, int len);
+bv hm_sb_get_str(rhhm *hm, char *s, int len, u32 hash); // hash: str_hash of s
 
 #endif // RHHM_H
 
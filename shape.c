@@ -0,0 +1,71 @@
+#include "shape.h"
+
+static shape *shape_new(shape *parent, bv key) {
+	shape *s = ml_payload.alloc(ml_payload.ctx, parent, sizeof(shape));
+	if (!s) return NULL;
+	s->parent = parent;
+	s->key = key;
+	s->nslots = parent ? parent->nslots + 1 : 0;
+	rhhm_init(&s->transitions, 4, 0);
+	return s;
+}
+
+shape *shape_new_root() {
+	return shape_new(NULL, nil);
+}
+
+static void shape_destroy_child(void *context, rhhm_value *v) {
+	shape_destroy(bv_get_ptr(v->value));
+}
+
+void shape_destroy(shape *s) {
+	if (!s) return;
+	rhhm_visit(&s->transitions, NULL, shape_destroy_child);
+	rhhm_destroy(&s->transitions);
+	ml_payload.free(ml_payload.ctx, s, sizeof(shape));
+}
+
+i32 shape_find(shape *s, bv key) {
+	for (; s->nslots; s = s->parent)
+		if (s->key.u == key.u) return s->nslots-1;
+	return -1;
+}
+
+static shape *shape_child(shape *s, bv key) {
+	shape *n = shape_new(s, key);
+	if (!n) return NULL;
+	if (hm_set(&s->transitions, key, bv_make_ptr(n))) {
+		shape_destroy(n);
+		return NULL;
+	}
+	return n;
+}
+
+// the tree never shrinks, so only keys of the root (see shape_fix) grow it
+shape *shape_add(shape *s, bv key) {
+	if (s->nslots >= SHAPE_MAX_SLOTS) return NULL;
+
+	bv child = hm_get(&s->transitions, key);
+	if (!bv_is_nil(child)) return bv_get_ptr(child);
+
+	shape *r = s;
+	while (r->parent) r = r->parent;
+	if (r == s || bv_is_nil(hm_get(&r->transitions, key))) return NULL;
+	return shape_child(s, key);
+}
+
+int shape_fix(shape *root, bv key) {
+	if (!bv_is_nil(hm_get(&root->transitions, key))) return 0;
+	return !shape_child(root, key);
+}
+
+u32 shape_cap(u32 nslots) {
+	u32 c = 4;
+	while (c < nslots) c *= 2;
+	return c;
+}
+
+// interned strings compare by identity, so they can index slots
+int shape_is_key(bv key) {
+	return bv_is_str(key) || bv_is_sstr(key);
+}
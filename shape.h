@@ -0,0 +1,38 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "common.h"
+#include "value.h"
+#include "rhhm.h"
+
+/*
+ * Hidden classes for string keyed tables
+ *
+ * A shape is the ordered set of string keys of a table: adding a key follows
+ * (or creates) a transition to a child shape, so tables built the same way
+ * share shapes and keep their values in a flat slots array. Past
+ * SHAPE_MAX_SLOTS keys, or at one that is not a constant of compiled code
+ * (shape_fix), a table drops its shape and uses the hash part.
+ */
+#define SHAPE_MAX_SLOTS 32
+#define SHAPE_NONE ((shape*)~UINT64_C(0)) // never a table's shape
+
+typedef struct shape {
+	struct shape *parent;
+	bv key;           // added by this shape, lives in slot nslots-1
+	u32 nslots;
+	rhhm transitions; // key -> child shape
+} shape;
+
+shape *shape_new_root();
+void shape_destroy(shape *s); // s and all its children
+
+i32 shape_find(shape *s, bv key);
+shape *shape_add(shape *s, bv key); // NULL if out of memory, slots or not fixed
+int shape_fix(shape *root, bv key); // key grows shapes, it must never be freed
+
+u32 shape_cap(u32 nslots); // slots array size for nslots
+
+int shape_is_key(bv key);
+
+#endif // SHAPE_H
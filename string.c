@@ -2,18 +2,96 @@
 
 #include <string.h>
 
-#define smalloc malloc
-#define sfree free
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-str *str_new(const char *s, u32 len) {
-	str *o = smalloc(sizeof(str)+len);
+/*
+ * wyhash: 64x64->128 multiply and fold, long strings go through three
+ * independent lanes of 16 bytes so the multiplies overlap
+ */
+#define WY0 UINT64_C(0xa0761d6478bd642f)
+#define WY1 UINT64_C(0xe7037ed1a0b428db)
+#define WY2 UINT64_C(0x8ebc6af09c88c6e3)
+#define WY3 UINT64_C(0x589965cc75374cc3)
+
+static inline u64 wymix(u64 a, u64 b) {
+	__uint128_t r = (__uint128_t)a * b;
+	return (u64)r ^ (u64)(r >> 64);
+}
+
+static inline u64 wyr8(const u8 *p) { u64 v; memcpy(&v, p, 8); return v; }
+static inline u64 wyr4(const u8 *p) { u32 v; memcpy(&v, p, 4); return v; }
+
+u32 str_hash(const char *s, u32 len, u64 seed) {
+	const u8 *p = (const u8*)s;
+	u64 a, b;
+	seed ^= wymix(seed ^ WY0, WY1);
+	if (len <= 16) {
+		if (len >= 4) {
+			u32 m = (len >> 3) << 2;
+			a = wyr4(p) << 32 | wyr4(p + m);
+			b = wyr4(p + len - 4) << 32 | wyr4(p + len - 4 - m);
+		} else if (len) {
+			a = (u64)p[0] << 16 | (u64)p[len >> 1] << 8 | p[len - 1];
+			b = 0;
+		} else a = b = 0;
+	} else {
+		u32 i = len;
+		if (i > 48) {
+			u64 s1 = seed, s2 = seed;
+			do {
+				seed = wymix(wyr8(p) ^ WY1, wyr8(p + 8) ^ seed);
+				s1 = wymix(wyr8(p + 16) ^ WY2, wyr8(p + 24) ^ s1);
+				s2 = wymix(wyr8(p + 32) ^ WY3, wyr8(p + 40) ^ s2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= s1 ^ s2;
+		}
+		for (; i > 16; i -= 16, p += 16)
+			seed = wymix(wyr8(p) ^ WY1, wyr8(p + 8) ^ seed);
+		a = wyr8(p + i - 16);
+		b = wyr8(p + i - 8);
+	}
+	__uint128_t r = (__uint128_t)(a ^ WY1) * (b ^ seed);
+	return wymix((u64)r ^ WY0 ^ len, (u64)(r >> 64) ^ WY1);
+}
+
+// 16 bytes at a time, the tail overlaps the last full block
+int str_cmp(const char *a, const char *b, u32 len) {
+#ifdef __SSE2__
+	if (len >= 16) {
+		u32 i;
+		for (i = 0; i + 16 <= len; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+			__m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) return 1;
+		}
+		if (i == len) return 0;
+		__m128i x = _mm_loadu_si128((const __m128i*)(a + len - 16));
+		__m128i y = _mm_loadu_si128((const __m128i*)(b + len - 16));
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff;
+	}
+#endif
+	if (len >= 8)
+		return ((wyr8((const u8*)a) ^ wyr8((const u8*)b)) |
+			(wyr8((const u8*)a + len - 8) ^ wyr8((const u8*)b + len - 8))) != 0;
+	return memcmp(a, b, len) != 0;
+}
+
+str *str_new(const char *s, u32 len, u32 hash, ml_alloc f, void *ud) {
+	str *o = f(ud, NULL, 0, sizeof(str)+len);
 	if (o) {
+		o->next = NULL;
 		o->sz = len;
+		o->gcflags = 0;
+		o->hash = hash;
 		memcpy(o->data, s, len);
 	}
 	return o;
 }
 
-void str_delete(str *s) {
-	sfree(s);
+void str_delete(str *s, ml_alloc f, void *ud) {
+	f(ud, s, sizeof(str)+s->sz, 0);
 }
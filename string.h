@@ -4,13 +4,18 @@
 #include "common.h"
 
 typedef struct str {
-	struct str *next;
+	struct str *next; // collectable strings, see gc.strings
 	u32 sz;
+	u32 gcflags;
+	u32 hash; // str_hash of data with the state's seed, for the pool and table keys
 	char data[1];
 } str;
 
-str *str_new(const char *s, u32 len);
-void str_delete(str *s);
+u32 str_hash(const char *s, u32 len, u64 seed); // whole string
+int str_cmp(const char *a, const char *b, u32 len); // 0 if equal
+// from allocator f
+str *str_new(const char *s, u32 len, u32 hash, ml_alloc f, void *ud);
+void str_delete(str *s, ml_alloc f, void *ud);
 
 #endif // STRING_H
 
@@ -0,0 +1,40 @@
+-- tables only held by the stack survive the atomic step of a major cycle
+local keep = {}
+keep[1] = {7, 8}
+gc()
+print(keep[1][1], keep[1][2])
+
+function f(n)
+  local a = {}
+  a.v = {1}
+  for i = 1, n do
+    local q = {i}
+    a.last = q
+  end
+  gc()
+  print(a.v[1], a.last[1])
+end
+f(200001)
+
+live = table.new(200000, 0)
+for i=1,200001 do live[i] = {i, {i}} end
+gc()
+gc()
+local s = 0
+for i=1,200001 do
+  local t = live[i]
+  s = s + t[2][1]
+end
+print(s)
+
+gc("threads", 4)
+old = table.new(400000, 0)
+for i=1,400001 do old[i] = {i} end
+gc()
+gc()
+local n = 0
+for i=1,400001 do
+  local t = old[i]
+  n = n + t[1]
+end
+print(n)
@@ -14,17 +14,23 @@ bv bv_make_tbl(void *p) { bv v; v.p = p; v.u |= bv_tbl; return v; }
 bv bv_make_ptr(void *p) { bv v; v.p = p; v.u |= bv_ptr; return v; }
 bv bv_make_sstr(const char *s, u32 len) {
 	bv v;
-	if (len > SSTR_MAX_LENGTH) len = SSTR_MAX_LENGTH;
+	if (len >= SSTR_MAX_LENGTH) {
+		v.u = bv_sstr6;
+		memcpy(&v, s, SSTR_MAX_LENGTH);
+		return v;
+	}
 	v.u = bv_sstr | len;
 	memcpy(((char*)&v)+1, s, len);
 	return v;
 }
 
 char *bv_get_sstr(bv *v) {
+	if (bv_type(*v) == bv_sstr6) return (char*)v;
 	return bv_is_sstr(*v) ? ((char*)v)+1 : NULL;
 }
 
 int bv_get_sstr_len(bv v) {
+	if (bv_type(v) == bv_sstr6) return SSTR_MAX_LENGTH;
 	return bv_is_sstr(v) ? v.u & 0xf : -66;
 }
 
@@ -41,7 +47,7 @@ int bv_is_double(bv v) {
 }
 int bv_is_nil(bv v) { return v.u == bv_nil; }
 int bv_is_str(bv v) { return (v.u&bv_type_mask) == bv_str; }
-int bv_is_sstr(bv v) { return (v.u&bv_type_mask) == bv_sstr; }
+int bv_is_sstr(bv v) { return (v.u&bv_type_mask) - bv_sstr <= bv_sstr6 - bv_sstr; }
 
 int bv_is_tbl(bv v) {
 	return (v.u&bv_type_mask) == bv_tbl;
@@ -155,6 +161,7 @@ void bv_disp(bv v) {
 	case bv_bool: printf("bool"); break;
 	case bv_str: printf("str"); break;
 	case bv_sstr:
+	case bv_sstr6:
 		printf("%.*s", bv_get_sstr_len(v), bv_get_sstr(&v));
 		break;
 	case bv_tbl: printf("table: %p", v.p); break;
@@ -28,11 +28,12 @@ typedef union {
 #define bv_ptr        UINT64_C(0x7ff8000000000000)
 #define bv_str        UINT64_C(0x7ff9000000000000)
 #define bv_tbl        UINT64_C(0x7ffa000000000000)
-#define bv_sstr       UINT64_C(0x7ffb000000000000)
+#define bv_sstr       UINT64_C(0x7ffb000000000000) // length in the low byte, then up to 5 chars
+#define bv_sstr6      UINT64_C(0x7ffc000000000000) // 6 chars, the whole payload
 //#define bv_unused   UINT64_C(0x7fff000000000000)
 
 
-#define SSTR_MAX_LENGTH 5
+#define SSTR_MAX_LENGTH 6
 
 extern const bv nil;
 
@@ -1,32 +1,48 @@
 #ifndef VEC_H
 #define VEC_H
 
-// TODO
+#include "common.h"
+#include "value.h"
 
+/*
+ * Dense bv array, used as the array part of tables.
+ * data is allocated lazily, slots in [sz, cap) are nil.
+ */
 typedef struct { bv *data; u32 cap; u32 sz; } vec;
-int vec_maybe_resize(vec *v, u32 c) {
+
+static inline int vec_maybe_resize(vec *v, u32 c) {
 	if (c <= v->cap) return 0;
 	u32 n = 8; bv *d;
 	while (n < c) n *= 2;
-	d = ML_REALLOC(v->data, n*sizeof(bv));
+	d = ml_payload.realloc(ml_payload.ctx, v, v->data, v->cap*sizeof(bv), n*sizeof(bv));
 	if (!d) return 1;
 	for (c = v->cap; c < n; c++) d[c] = nil;
 	v->data = d; v->cap = n;
 	return 0;
 }
-int vec_init(vec *v, u32 c) {
+
+static inline int vec_init(vec *v, u32 c) {
 	v->data = NULL; v->cap = v->sz = 0;
 	if (vec_maybe_resize(v, c)) return 1;
 	return 0;
 }
-void vec_destroy(vec *v) { if (v) ML_FREE(v->data); }
-int vec_set(vec *v, u32 i, bv val) {
-	if (vec_maybe_resize(v, i)) return 1;
+
+static inline void vec_destroy(vec *v) { if (v) ml_payload.free(ml_payload.ctx, v->data, v->cap*sizeof(bv)); }
+
+static inline int vec_set(vec *v, u32 i, bv val) {
+	if (vec_maybe_resize(v, i+1)) return 1;
 	if (i >= v->sz) v->sz = i+1;
 	v->data[i] = val;
 	return 0;
 }
-bv vec_at(vec *v, u32 i) { return i < v->sz ? v->data[i] : nil; }
 
-#endif // VEC_H
+static inline int vec_push(vec *v, bv val) { return vec_set(v, v->sz, val); }
 
+static inline bv vec_at(vec *v, u32 i) { return i < v->sz ? v->data[i] : nil; }
+
+// drop trailing nils, so data[sz-1] is never nil
+static inline void vec_trim(vec *v) {
+	while (v->sz && bv_is_nil(v->data[v->sz-1])) v->sz--;
+}
+
+#endif // VEC_H
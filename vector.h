@@ -1,20 +1,47 @@
 #ifndef VECTOR_H
 #define VECTOR_H
 
-#define vdef(name, type, cap)   \
+#include "common.h"
+
+#include <string.h>
+
+/*
+ * Growable arrays, data doubles through ML_REALLOC. vpush and vreserve are 0
+ * on success and 1 when out of memory, pointers into data don't survive them.
+ */
+#define VECTOR_MIN_CAP 16
+
+#define vdef(name, type)        \
 	typedef struct {        \
 		int size;       \
-		type data[cap]; \
+		int cap;        \
+		type *data;     \
 	} name;
 
+// pdata is the address of the data pointer, copied through so any type works
+static inline int vector_grow(void *pdata, int *cap, int n, size_t esz) {
+	int c = *cap ? *cap : VECTOR_MIN_CAP;
+	void *d;
+	while (c < n) c *= 2;
+	memcpy(&d, pdata, sizeof d);
+	if (!(d = ML_REALLOC(d, c * esz))) return 1;
+	memcpy(pdata, &d, sizeof d);
+	*cap = c;
+	return 0;
+}
+
+#define vinit(v)    do { (v).size = (v).cap = 0; (v).data = NULL; } while (0)
+#define vdestroy(v) do { ML_FREE((v).data); vinit(v); } while (0)
+
 #define vclear(v)   do { v.size = 0; } while (0)
 #define vsize(v)    (v.size)
-#define vcap(v)     (sizeof(v.data)/sizeof(v.data[0]))
+#define vcap(v)     (v.cap)
 
 #define vempty(v)   (v.size == 0)
 #define vfull(v)    (v.size == vcap(v))
 
-#define vpush(v,e)  (v.data[v.size++] = e)
+#define vreserve(v,n) ((n) <= (v).cap ? 0 : vector_grow(&(v).data, &(v).cap, (n), sizeof *(v).data))
+#define vpush(v,e)  (vreserve(v, (v).size+1) || ((v).data[(v).size++] = (e), 0))
 #define vpop(v)     (v.data[--v.size])
 
 #define vget(v,i)   (v.data[i])
@@ -27,4 +54,3 @@
 #define vback(v)    (v.data[v.size-1])
 
 #endif /* VECTOR_H */
-